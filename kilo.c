@@ -9,21 +9,77 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <locale.h>
+#include <stdarg.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
+#include <wchar.h>
+#include <zlib.h>
+
+#if defined(__x86_64__) || defined(__SSE2__)
+#include <emmintrin.h>
+#define KILO_SSE2 1
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define KILO_AVX2 1
+#endif
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define KILO_URING 1
+#endif
 
 
 /*** defines ****/
 
 #define KILO_VERSION "0.0.1"
+#define KILO_QUIT_TIMES 3
+
+// Lazy rows: bytes indexed per step, default rows around the screen
+#define LAZY_INDEX_CHUNK (1024 * 1024)
+#define LAZY_MARGIN 256
+
+// Pager: page size, lines between checkpoints, longest row kept, budget
+#define PAGER_PAGE (64 * 1024)
+#define PAGER_CHECKPOINT 4096
+#define PAGER_MAXLINE (64 * 1024)
+#define PAGER_BUDGET (64 * 1024 * 1024)
+
+// Parallel indexing: fewest bytes worth a thread, most threads
+#define INDEX_SPLIT_MIN (4 * 1024 * 1024)
+#define INDEX_MAX_THREADS 64
+
+// gzip: compressed bytes per read, output address space, commit step
+#define GZ_INPUT (256 * 1024)
+#define GZ_RESERVE ((size_t)1 << 40)
+#define GZ_COMMIT (64 * 1024 * 1024)
+
+// Chunked reads: bytes per read, reads kept in flight
+#define READ_CHUNK (1024 * 1024)
+#define READ_DEPTH 8
+
+// Cold store: match finder hash bits, decompressed blocks kept
+#define COLD_HASH_BITS 12
+#define COLD_CACHE 32
 
 // Ctrl Key combinations
 #define CTRL_KEY(k) ((k) & 0x1f)
 
 // Arrow keys
 enum editorKey {
+    BACKSPACE = 127,
     ARROW_LEFT = 1000,
     ARROW_RIGHT,
     ARROW_UP,
@@ -39,27 +95,426 @@ enum editorKey {
 /*** data ***/
 
 
+// Where the bytes of a row live
+enum rowStorage {
+    ROW_MAPPED = 0, // Clean view into the file image, read-only
+    ROW_ARENA,      // Copied into the row arena, freed with the arena,
+                    // maybe shared by identical rows (-d)
+    ROW_HEAP,       // Own malloc'd block
+    ROW_INLINE      // Short row stored in the erow itself
+};
+
+/*
+ * Rows up to ROW_INLINE_MAX bytes live inside the erow, which keeps
+ * an erow at 32 bytes (with a 64-bit size); two per cache line and
+ * no pointer to chase when drawing. Use erowChars() rather than the
+ * union directly
+ */
+#define ROW_INLINE_MAX 15
+
+/*
+ * What the bytes of a row are, worked out by utf8Classify() the
+ * first time anybody asks and kept until the row is written
+ */
+enum rowEncoding {
+    ENC_UNKNOWN = 0,
+    ENC_ASCII,   // Every byte is one column (no tabs), the fast path
+    ENC_UTF8,    // Valid UTF-8 whose columns need counting: multibyte
+                 // sequences or tabs
+    ENC_INVALID  // Not UTF-8, treated as bytes
+};
+
+// How a row ended in the file, written back the same way on save
+enum rowEol {
+    EOL_LF = 0,
+    EOL_CRLF,
+    EOL_NONE    // Last row of a file without a final newline
+};
+
+// Line endings of the whole file, counted while indexing
+enum fileEol {
+    EOLS_LF = 0,
+    EOLS_CRLF,
+    EOLS_MIXED
+};
+
 // Define ONE row in the text editor
 typedef struct erow {
-    int size;
-    char* chars;
+    ssize_t size;
+    unsigned char storage; // enum rowStorage
+    unsigned char enc;     // enum rowEncoding
+    unsigned char eol;     // enum rowEol, array backend only
+    union {
+        char* chars;
+        char inl[ROW_INLINE_MAX + 1];
+    } u;
 }erow;
 
+/*
+ * Bump allocator for row bytes, rows loaded together are
+ * freed together so there is no need to track them one by one
+ */
+struct arenachunk {
+    struct arenachunk* next;
+    size_t used;
+    size_t cap;
+    char data[];
+};
+
+struct arena {
+    struct arenachunk* head;
+};
+
+/*
+ * Lines seen so far while loading with -d, rows with the same bytes
+ * end up pointing at one arena copy. Only lives through the load
+ */
+struct internslot {
+    const char* chars;  // NULL when free
+    ssize_t size;
+    unsigned char enc;
+    unsigned long long hash;
+};
+
+struct interntab {
+    struct internslot* slots;
+    size_t cap;         // Power of two, kept at most half full
+    size_t used;
+};
+
+/*
+ * Where every line of the file image starts, plus a sentinel
+ * so that line i is [offs[i], offs[i+1] - 1)
+ */
+struct lineindex {
+    size_t* offs;
+    size_t len;
+    size_t cap;
+};
+
+/*
+ * Text tree: the B-tree the piece table and the rope both keep their
+ * text in. Every node knows how many bytes and '\n's are below it, so
+ * both a byte offset and a line number can be found in O(log n) by
+ * walking down the tree. Only the leaves differ, each kind starts
+ * with a struct treenode and comes with a struct treeleaf that the
+ * walks ask about what is inside
+ */
+#define TREE_FANOUT 16
+
+struct treenode {
+    size_t bytes;
+    size_t nls;
+    int leaf;
+    int n; // Children, or what a leaf holds for leaves that count it
+    struct treenode* child[TREE_FANOUT + 1]; // One spare while splitting
+};
+
+struct treeleaf {
+    size_t size; // Of the leaf struct
+    // The leaf's bytes from off on, as far as they are contiguous
+    char* (*text)(struct treenode* leaf, size_t off, size_t* avail);
+    // Offset in the leaf just past its k-th '\n', k >= 1
+    size_t (*rowpos)(struct treenode* leaf, size_t k);
+    // '\n's in the leaf before off
+    size_t (*newlines)(struct treenode* leaf, size_t off);
+    /*
+     * Put len bytes described by `what` at off, returns a new right
+     * sibling when the leaf had to be split
+     */
+    struct treenode* (*insert)(struct treenode* leaf, size_t off,
+            const void* what, size_t len);
+    void (*remove)(struct treenode* leaf, size_t off, size_t len);
+    void (*free)(struct treenode* leaf); // NULL when there's nothing to
+};
+
+struct tree {
+    struct treenode* root;
+    const struct treeleaf* type;
+    ssize_t nextrow;    // Row starting at nextpos, to draw rows in order
+    size_t nextpos;
+    char* line;         // Rows spanning leaves are joined here
+    size_t linecap;
+    erow row;           // What treeRow() hands out
+};
+
+/*
+ * Piece table: the document is the concatenation of pieces, each
+ * a slice of either the original file or the append-only add buffer.
+ * Every buffer keeps the offsets just past its '\n' bytes so that
+ * lines can be found without scanning the text. The pieces sit in
+ * the leaves of a text tree, so finding an offset or a line and
+ * splitting or adding a piece are O(log n) in the number of pieces
+ */
+#define PT_LEAF_MAX 32
+
+struct ptbuffer {
+    char* data;
+    size_t len;
+    size_t cap;
+    struct lineindex nl;
+};
+
+struct piece {
+    int buf;      // PT_ORIG or PT_ADD
+    size_t start; // Offset within the buffer
+    size_t len;
+    size_t nls;   // '\n' bytes inside the piece
+};
+
+// A leaf of pieces, t.n of them
+struct ptleaf {
+    struct treenode t;
+    struct piece pieces[PT_LEAF_MAX + 2]; // Two spare while splitting
+};
+
+struct piecetable {
+    struct ptbuffer buf[2];
+    struct tree tree;
+};
+
+/*
+ * Rope: a text tree whose leaves are chunks of text
+ */
+#define ROPE_LEAF_MAX 4096
+
+struct ropeleaf {
+    struct treenode t;
+    char* text;  // A view into the file image until written
+    int owned;   // text was malloc'd with ROPE_LEAF_MAX bytes of room
+};
+
+struct rope {
+    struct tree tree;
+    char* orig;       // File image the clean leaves point into
+};
+
+/*
+ * Background loader: a thread indexes the mapped file while the
+ * main loop already draws what is indexed. The thread appends to
+ * offs and then publishes count; when offs is full it switches to
+ * a bigger copy and keeps the old one alive until it is joined, so
+ * the main thread can read any published entry without locking
+ */
+#define LOADER_MAX_RETIRED 64
+
+/*
+ * Streaming gzip input: a thread inflates the file into one big
+ * address space reservation (so the text never moves while the line
+ * index and rows point into it) and hands each new stretch of output
+ * to the loader thread, which indexes it while the next is inflated
+ */
+struct gzstream {
+    pthread_t thread;
+    int running;      // Started and not joined yet (main thread only)
+    int fd;
+    char* image;      // GZ_RESERVE bytes (or less) of address space
+    size_t reserve;
+    size_t committed; // Made readable and writable so far
+    off_t insize;     // Compressed size, for the progress indicator
+    size_t consumed;  // Compressed bytes read (atomic)
+    int error;        // Input was corrupt or truncated (atomic)
+    int stop;         // Main thread wants the thread gone (atomic)
+
+    pthread_mutex_t lock;
+    pthread_cond_t more;
+    size_t avail;     // Bytes of image inflated (lock)
+    int done;         // No more output coming (lock)
+};
+
+struct loader {
+    pthread_t thread;
+    int running;      // Started and not joined yet (main thread only)
+    size_t* offs;     // Published line starts, replaced when full
+    size_t len;       // Loader thread only
+    size_t cap;
+    size_t count;     // Entries of offs readers may use (atomic)
+    size_t scanned;   // Bytes indexed, for the progress indicator (atomic)
+    int done;         // (atomic)
+    int stop;         // Main thread wants the loader gone (atomic)
+    struct gzstream* src; // Text still arriving from here, NULL if not
+    size_t* retired[LOADER_MAX_RETIRED];
+    int nretired;
+};
+
+/*
+ * Out-of-core pager: nothing but an offset every PAGER_CHECKPOINT
+ * lines is kept for the whole file, text is pread() into a fixed
+ * set of pages as the viewport needs it, so memory stays within
+ * the budget whatever the size of the file
+ */
+struct pagerpage {
+    off_t off;  // File offset of the page, -1 when unused
+    ssize_t len;
+    char* data;
+    unsigned long used; // When it was last asked for (cold store LRU)
+};
+
+/*
+ * Cold store: the text kept in memory compressed, one block per
+ * pager page. The pager reads pages out of it instead of the file
+ * and keeps the few blocks around the screen decompressed
+ */
+struct coldblock {
+    char* data;
+    int clen;   // Compressed size, or -1 when stored as is
+};
+
+struct coldstore {
+    struct coldblock* blocks;
+    size_t nblocks;
+    size_t bytes;    // Held by the compressed blocks
+};
+
+struct pager {
+    int fd;          // -1 when the pages come from the cold store
+    off_t size;
+    struct coldstore cold;
+    unsigned long tick;
+    struct pagerpage* pages; // Direct mapped on the page number
+    int npages;
+    off_t* checkpoints;      // Start of line i * PAGER_CHECKPOINT
+    size_t ncheckpoints;
+    size_t checkcap;
+    off_t scanned;           // Bytes counted so far
+    ssize_t lines;           // Complete lines in those bytes
+    char lastbyte;
+    ssize_t currow;          // A row whose start we know, to step
+    off_t curpos;            // from instead of from a checkpoint
+    char* line;              // Up to PAGER_MAXLINE bytes of a row
+    erow row;
+};
+
+/*
+ * Struct-of-arrays rows: where a row starts is the line index, its
+ * size and flags live in arrays of their own, so passes over every
+ * row only stream through the bytes they need
+ */
+#define ROWF_CRLF 1 // The row ended with "\r\n"
+#define ROWF_ENC_SHIFT 1 // enum rowEncoding in the next two bits
+#define ROWF_ENC_MASK (3 << ROWF_ENC_SHIFT)
+
+struct rowsoa {
+    ssize_t* sizes;
+    unsigned char* flags;
+    erow row; // What soaRow() hands out
+};
+
+/*
+ * We need a data structure to append strings to a buffer
+ * and finally make a big write than byte size writes
+ * as it can flicker. The ones frames are drawn into are kept
+ * from one refresh to the next, len goes back to 0 but the
+ * memory stays
+ */
+struct abuf {
+    char *b;
+    size_t len;
+    size_t cap;
+};
+
+#define ABUF_INIT {NULL, 0, 0}
+
+/*
+ * One cell of the screen: the bytes of the code point drawn there
+ * (a single byte on rows that aren't UTF-8), any combining marks
+ * that fit after it, and its attributes. A wide character fills
+ * its cell and a CELL_TAIL one after it, which is never written
+ * on its own
+ */
+#define CELL_REVERSE 1
+#define CELL_TAIL 2
+
+struct cell {
+    unsigned char len;  // 0 when we don't know what the terminal shows
+    unsigned char attr;
+    char ch[8];
+};
+
+/*
+ * What the terminal shows since the last refresh, so the next one
+ * only rewrites the lines that changed and a cursor move on its own
+ * costs just the escape that moves it
+ */
+struct screen {
+    int drawn;             // Anything on the terminal yet
+    int rows, cols;        // Size it was drawn at
+    ssize_t rowoff, coloff; // Viewport it was drawn at
+    ssize_t numrows;
+    unsigned char* damage; // Text lines to compose again, one per screen row
+    struct cell* cells;    // What the terminal shows, rows + 2 bars
+    struct cell* next;     // The frame being composed
+    int cursory, cursorx;  // Where the cursor was left
+    int sync;              // Terminal shows a frame at once (mode 2026)
+    struct abuf frame;     // Escapes of the frame being written
+    struct abuf bar;       // Text of one bar while it's composed
+};
+
+// Which structure holds the text
+enum editorBackend {
+    BACKEND_ARRAY = 0, // One erow per line
+    BACKEND_PIECE,     // Piece table over the file image
+    BACKEND_ROPE,      // B-tree of text chunks
+    BACKEND_SOA,       // Row sizes and flags in flat arrays
+    BACKEND_LAZY,      // Line index, erows only around the viewport
+    BACKEND_PAGER      // Read-only, sparse index and paged reads
+};
+
 // Maintain out terminal state
 struct editorConfig {
-    int cx, cy; // Maintain cursor position
-    int rowoff; //The row offset the user is @
-    int coloff; //The column offset the user is @
+    ssize_t cx, cy; // Maintain cursor position
+    ssize_t rx; // Screen column of cx, differs from it on UTF-8 rows
+    ssize_t rowoff; //The row offset the user is @
+    ssize_t coloff; //The column offset the user is @
     int screenrows;
     int screencols;
-    int numrows;
+    ssize_t numrows;
+    ssize_t rowcap; // Allocated slots in row, grows geometrically
     erow* row;
+    struct arena rowarena; // Bytes of the ROW_ARENA rows
+    int intern; // Share one copy between identical rows (array)
+    size_t internsaved; // Bytes the sharing saved on the last load
+    char* filemap; // File image: read-only mapping of the opened file,
+    size_t filemapsize;
+    int filemapheap; // or read into the heap when it couldn't be mapped
+    int dirty; // Edits since the file was opened or saved
+    int indexstale; // Edited since the line index was built, saved or not
+    int eolstyle; // enum fileEol
+    int neweol; // enum rowEol for rows we make, what most rows use
+    struct lineindex index; // Line starts within filemap
+    int backend; // enum editorBackend
+    size_t indexed; // Bytes of filemap the index covers so far (lazy)
+    int indexdone;
+    ssize_t winstart; // First row materialized in row (lazy)
+    ssize_t winlen;
+    int lazymargin; // Rows kept materialized above and below the screen
+    int async; // Index in a background thread (lazy)
+    int chunkedread; // Read with overlapping io_uring reads instead of mmap
+    int coldstore; // Page through the text compressed in memory (pager)
+    int indexthreads; // Threads building the line index of a whole file
+    struct loader loader;
+    struct gzstream gz; // Inflating a .gz file in the background
+    struct pager pager;
+    struct rowsoa soa;
+    size_t pagerbudget; // Bytes the pager may keep in memory
+    char* filename;
+    char statusmsg[80];
+    time_t statusmsg_time;
+    struct piecetable pt;
+    struct rope rope;
+    struct screen screen;
     struct termios orig_termios; // Original terminal state    
 };
 
 struct editorConfig E;
 
 
+/*** prototypes ***/
+
+void editorSetStatusMessage(const char *fmt, ...);
+void editorSetCursor(ssize_t row, ssize_t col);
+
+
 /*** terminal stuff ***/
 
 // Handle errors gracefully
@@ -129,6 +584,8 @@ int editorReadKey() {
     char c;
     while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
         if (nread == -1 && errno != EAGAIN) die("read");
+        // Nothing typed, go back and draw what the loader has so far
+        if (nread == 0 && E.loader.running) return 0;
     }
 
     // If we get a special sequence (something like arrow keys)
@@ -242,230 +699,3679 @@ int getWindowSize(int *rows, int *cols) {
 }
 
 
-/*** row operations  ***/
+/*
+ * Ask whether the terminal can hold a frame back until all of it has
+ * arrived (synchronized output, private mode 2026) with DECRQM:
+ * "<esc>[?2026$p" is answered "<esc>[?2026;<state>$y", where 1 (set)
+ * and 2 (reset) mean it knows the mode and 0 or no answer means it
+ * doesn't. Every terminal answers the device attributes query sent
+ * after it, so we read until that reply ends, giving a slow link
+ * (ssh) up to SYNC_QUERY_TIMEOUT ms. Anything left over is thrown
+ * away so it isn't read as keys later
+ */
+#define SYNC_QUERY_TIMEOUT 1000
 
-void editorAppendRow(char* s, size_t len) {
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
+int getSyncOutput() {
+    char buf[128], c;
+    unsigned int i = 0;
+    int state = 0;
+    struct timespec start, now;
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
 
-    int at = E.numrows;
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len+1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
-    E.numrows++;
+    const char q[] = "\x1b[?2026$p\x1b[c";
+    if (write(STDOUT_FILENO, q, sizeof(q) - 1) != sizeof(q) - 1) return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (1) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long left = SYNC_QUERY_TIMEOUT - (now.tv_sec - start.tv_sec) * 1000 -
+            (now.tv_nsec - start.tv_nsec) / 1000000;
+        if (left <= 0) break;
+        int ready = poll(&pfd, 1, left);
+        if (ready == -1 && errno == EINTR) continue;
+        if (ready <= 0 || read(STDIN_FILENO, &c, 1) != 1) break;
+        if (i < sizeof(buf) - 1) buf[i++] = c;
+        if (c == 'c') break;
+    }
+    buf[i] = '\0';
+    tcflush(STDIN_FILENO, TCIFLUSH);
+
+    char* reply = strstr(buf, "\x1b[?2026;");
+    if (reply == NULL || sscanf(reply + 8, "%d$y", &state) != 1) return 0;
+    return state == 1 || state == 2;
 }
 
 
-/*** file i/o  ***/
+/*** line index ***/
+
+// Make room for n more offsets
+void lineIndexReserve(struct lineindex* li, size_t n) {
+    if (li->cap - li->len >= n) return;
+    while (li->cap - li->len < n)
+        li->cap = li->cap ? li->cap * 2 : 1024;
+    li->offs = realloc(li->offs, sizeof(size_t) * li->cap);
+    if (li->offs == NULL) die("realloc");
+}
+
+void lineIndexPush(struct lineindex* li, size_t off) {
+    lineIndexReserve(li, 1);
+    li->offs[li->len++] = off;
+}
+
+void lineIndexFree(struct lineindex* li) {
+    free(li->offs);
+    li->offs = NULL;
+    li->len = li->cap = 0;
+}
 
 /*
- * Allow the user to open an actual file to edit :-)
+ * Scalar fallback, memchr() is the best we can do portably
  */
-void editorOpen(char* filename) {
-    FILE* fp = fopen(filename, "r");
-    if(!fp) die("fopen");
-
-    char* line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    while ((linelen = getline(&line, &linecap, fp)) != -1) {
-        while (linelen>0 && (line[linelen-1] == '\n' || line[linelen-1] == '\r'))
-            linelen--;
-        editorAppendRow(line, linelen);
+void lineIndexScanScalar(struct lineindex* li, const char* buf, size_t len) {
+    const char* p = buf;
+    const char* end = buf + len;
+    while (p < end && (p = memchr(p, '\n', end - p)) != NULL) {
+        p++;
+        lineIndexPush(li, p - buf);
     }
-    free(line);
-    fclose(fp);
 }
 
-/*** append buffer ***/
+#ifdef KILO_SSE2
+/*
+ * Compare 16 bytes at a time against '\n' and walk the set
+ * bits of the movemasks, one bit per line break
+ */
+void lineIndexScanSSE2(struct lineindex* li, const char* buf, size_t len) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t i = 0;
+
+    // 64 bytes per step so stretches without breaks cost one branch
+    for (; i + 64 <= len; i += 64) {
+        const __m128i* p = (const __m128i*)(buf + i);
+        __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128(p), nl);
+        __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128(p + 1), nl);
+        __m128i c = _mm_cmpeq_epi8(_mm_loadu_si128(p + 2), nl);
+        __m128i d = _mm_cmpeq_epi8(_mm_loadu_si128(p + 3), nl);
+        __m128i any = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+        if (_mm_movemask_epi8(any) == 0) continue;
+
+        unsigned long long mask =
+            (unsigned long long)(unsigned)_mm_movemask_epi8(a) |
+            (unsigned long long)(unsigned)_mm_movemask_epi8(b) << 16 |
+            (unsigned long long)(unsigned)_mm_movemask_epi8(c) << 32 |
+            (unsigned long long)(unsigned)_mm_movemask_epi8(d) << 48;
+        lineIndexReserve(li, 64);
+        size_t* o = li->offs + li->len;
+        while (mask) {
+            *o++ = i + __builtin_ctzll(mask) + 1;
+            mask &= mask - 1;
+        }
+        li->len = o - li->offs;
+    }
+    for (; i < len; i++)
+        if (buf[i] == '\n') lineIndexPush(li, i + 1);
+}
+#endif
 
+#ifdef KILO_AVX2
 /*
- * We need a data structure to append strings to a buffer
- * and finally make a big write than byte size writes
- * as it can flicker
+ * Same as the SSE2 scanner with 32 byte vectors, only called
+ * when the CPU reports AVX2 support
  */
-struct abuf {
-    char *b;
-    int len;
-};
+__attribute__((target("avx2")))
+void lineIndexScanAVX2(struct lineindex* li, const char* buf, size_t len) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t i = 0;
+
+    for (; i + 64 <= len; i += 64) {
+        const __m256i* p = (const __m256i*)(buf + i);
+        __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256(p), nl);
+        __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256(p + 1), nl);
+        __m256i any = _mm256_or_si256(a, b);
+        if (_mm256_testz_si256(any, any)) continue;
 
-#define ABUF_INIT {NULL, 0}
+        unsigned long long mask =
+            (unsigned long long)(unsigned)_mm256_movemask_epi8(a) |
+            (unsigned long long)(unsigned)_mm256_movemask_epi8(b) << 32;
+        lineIndexReserve(li, 64);
+        size_t* o = li->offs + li->len;
+        while (mask) {
+            *o++ = i + __builtin_ctzll(mask) + 1;
+            mask &= mask - 1;
+        }
+        li->len = o - li->offs;
+    }
+    for (; i < len; i++)
+        if (buf[i] == '\n') lineIndexPush(li, i + 1);
+}
+#endif
 
-void abAppend(struct abuf *ab, const char *s, int len) {
-    char *new = realloc(ab->b, ab->len + len);
-    if (new == NULL) return;
+typedef void (*lineIndexScanFn)(struct lineindex*, const char*, size_t);
 
-    memcpy(&new[ab->len], s, len);
-    ab->b = new;
-    ab->len += len;
+// Pick the widest scanner this CPU can run
+lineIndexScanFn lineIndexScanner() {
+#ifdef KILO_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return lineIndexScanAVX2;
+#endif
+#ifdef KILO_SSE2
+    return lineIndexScanSSE2;
+#else
+    return lineIndexScanScalar;
+#endif
 }
 
-void abFree(struct abuf *ab) {
-    free(ab->b);
+/*
+ * Build the index of line starts for buf in a single pass
+ *
+ * Only '\n' is searched for, a '\r' can only matter right before
+ * it so it gets trimmed off the end of the line by the caller.
+ * A trailing '\n' doesn't start another line, its offset ends up
+ * as the sentinel; otherwise the sentinel is len + 1
+ */
+void lineIndexBuild(struct lineindex* li, const char* buf, size_t len,
+        lineIndexScanFn scan) {
+    li->len = 0;
+    lineIndexPush(li, 0);
+    scan(li, buf, len);
+    if (len > 0 && buf[len-1] != '\n')
+        lineIndexPush(li, len + 1);
 }
 
+/*
+ * One byte range of a parallel build: the scan fills a private index
+ * of offsets relative to the range, the stitch copies them to their
+ * final place once the line counts before the range are known
+ */
+struct indexjob {
+    const char* buf;
+    size_t from, len;
+    lineIndexScanFn scan;
+    struct lineindex local;
+    size_t* out;
+};
+
+void* lineIndexScanJob(void* arg) {
+    struct indexjob* job = arg;
+    job->scan(&job->local, job->buf + job->from, job->len);
+    return NULL;
+}
 
-/*** output ***/
+void* lineIndexStitchJob(void* arg) {
+    struct indexjob* job = arg;
+    size_t j;
+    for (j = 0; j < job->local.len; j++)
+        job->out[j] = job->local.offs[j] + job->from;
+    lineIndexFree(&job->local);
+    return NULL;
+}
+
+// Run fn on every job, each on its own thread but the first
+void lineIndexRunJobs(struct indexjob* jobs, int n, void* (*fn)(void*)) {
+    pthread_t tids[INDEX_MAX_THREADS];
+    int j;
 
+    for (j = 1; j < n; j++)
+        if (pthread_create(&tids[j], NULL, fn, &jobs[j]) != 0)
+            die("pthread_create");
+    fn(&jobs[0]);
+    for (j = 1; j < n; j++) pthread_join(tids[j], NULL);
+}
 
 /*
- * How to get the row offset ? 
- * We check if the cursor has gone out of the screen, and if it has
- * then, adjust E.rowoff so that the cursor is still in the screen
+ * Same index as lineIndexBuild, with buf split into byte ranges that
+ * are scanned on up to `threads` threads. A prefix sum of the line
+ * counts per range gives where each range's offsets go, and the
+ * threads copy them into place in parallel too
  */
-void editorScroll() {
-    if (E.cy < E.rowoff) {
-        E.rowoff = E.cy;
-    }
-    if (E.cy >= E.rowoff + E.screenrows) {
-        E.rowoff = E.cy - E.screenrows + 1;
+void lineIndexBuildParallel(struct lineindex* li, const char* buf, size_t len,
+        lineIndexScanFn scan, int threads) {
+    struct indexjob jobs[INDEX_MAX_THREADS];
+    size_t total = 0;
+    int j;
+
+    if (threads > INDEX_MAX_THREADS) threads = INDEX_MAX_THREADS;
+    if ((size_t)threads > len / INDEX_SPLIT_MIN) threads = len / INDEX_SPLIT_MIN;
+    if (threads <= 1) {
+        lineIndexBuild(li, buf, len, scan);
+        return;
     }
-    if (E.cx < E.coloff) {
-        E.coloff = E.cx;
+
+    for (j = 0; j < threads; j++) {
+        jobs[j].buf = buf;
+        jobs[j].from = len / threads * j;
+        jobs[j].len = (j == threads - 1 ? len : len / threads * (j + 1)) -
+            jobs[j].from;
+        jobs[j].scan = scan;
+        memset(&jobs[j].local, 0, sizeof(jobs[j].local));
     }
-    if (E.cx >= E.coloff + E.screencols) {
-        E.coloff = E.cx - E.screencols + 1;
+    lineIndexRunJobs(jobs, threads, lineIndexScanJob);
+
+    for (j = 0; j < threads; j++) total += jobs[j].local.len;
+    li->len = 0;
+    lineIndexReserve(li, total + 2);
+    li->offs[0] = 0;
+    for (j = 0, total = 1; j < threads; j++) {
+        jobs[j].out = li->offs + total;
+        total += jobs[j].local.len;
     }
+    lineIndexRunJobs(jobs, threads, lineIndexStitchJob);
+
+    li->len = total;
+    if (buf[len-1] != '\n')
+        lineIndexPush(li, len + 1);
 }
 
 /*
- * Draw ~ on left hand side of the screen at the end of the file
+ * Index up to chunk more bytes of buf, carrying on from *scanned
+ * Returns 1 once all of buf is covered and the sentinel is in
  */
-void editorDrawRows(struct abuf *ab) {
-    int y;
-    for (y=0; y<E.screenrows; y++) {
-        int filerow = y + E.rowoff;
-        /* 
-         * Check if there is something in text buffer
-         * If there is not then we draw the welcome page
-         * else we draw the text buffer
-         */
-        if (filerow >= E.numrows) {  
-            if (E.numrows == 0 && y == E.screenrows / 3) {
-                char welcome[80];
-                int welcomelen = snprintf(welcome, sizeof(welcome),
-                        "Aniket's Editor -- version %s", KILO_VERSION);
-                if (welcomelen > E.screencols) welcomelen = E.screencols;
-
-                /* Center the welcome message 
-                 * Divide the screen's width in half and subtract
-                 * half of the string's length. This gives us the
-                 * how far from left edge would we start printing
-                 */
-                int padding = (E.screencols - welcomelen) / 2;
-                if (padding) {
-                    abAppend(ab, "~", 1);
-                    padding--;
-                }
-                while (padding--) abAppend(ab, " ", 1);
-                abAppend(ab, welcome, welcomelen);
-            } else {
-                abAppend(ab, "~", 1);
-            } 
-        } else {
-            int len = E.row[filerow].size - E.coloff;
-            if (len < 0) len = 0;
-            if (len > E.screencols) len = E.screencols;
-            abAppend(ab, &E.row[filerow].chars[E.coloff], len);
-        }
+int lineIndexExtend(struct lineindex* li, const char* buf, size_t len,
+        size_t* scanned, size_t chunk, lineIndexScanFn scan) {
+    size_t from = *scanned;
+    size_t n = len - from < chunk ? len - from : chunk;
+    size_t j;
 
-        // Clear lines one at a time rather than entire screen refresh
-        abAppend(ab, "\x1b[K", 3);
-        if (y < E.screenrows -1) {
-            abAppend(ab, "\r\n", 2);
-        }
+    if (from == 0) {
+        li->len = 0;
+        lineIndexPush(li, 0);
     }
+
+    // The scanner works on offsets relative to what it was given
+    size_t first = li->len;
+    scan(li, buf + from, n);
+    for (j = first; j < li->len; j++) li->offs[j] += from;
+
+    *scanned = from + n;
+    if (*scanned < len) return 0;
+    if (len > 0 && buf[len-1] != '\n')
+        lineIndexPush(li, len + 1);
+    return 1;
 }
 
 /*
- * This is to clear the screen
- * We write 4 bytes
- * Byte 1 -> "\x1b" is the escape char(27 in decimal)
- * Byte 2 -> "[" (this always follows escape sequence)
- * Byte 3 -> "2" is the argument to byte 4, it says to clear entire screen
- * Byte 4 -> "J" is to clear the screen (https://vt100.net/docs/vt100-ug/chapter3.html#ED"
+ * Complete lines in the index, while it is still being built
+ * the last start pushed closes the line before it
  */
-void editorRefreshScreen() {
-    /*
-     * Make sure we are IN the screen
-     */
-    editorScroll();
+size_t lineIndexCount(struct lineindex* li) {
+    return li->len ? li->len - 1 : 0;
+}
 
-    struct abuf ab = ABUF_INIT;
+/*
+ * Fetch line i from buf (buflen bytes), without the line terminator,
+ * and which terminator it had if eol isn't NULL. Only a '\r' right
+ * before the '\n' belongs to the terminator, any others are text
+ */
+size_t lineIndexLine(struct lineindex* li, const char* buf, size_t buflen,
+        size_t i, const char** start, int* eol) {
+    size_t off = li->offs[i];
+    size_t len = li->offs[i+1] - 1 - off;
+    int ending = off + len < buflen ? EOL_LF : EOL_NONE;
 
-    /*
-     * It might happen that cursor might show up for a second when
-     * the terminal is drawing to the screen
-     * So we hide the cursor and display again when ready
-     */
-    abAppend(&ab, "\x1b[?25l", 6);
+    if (ending == EOL_LF && len > 0 && buf[off+len-1] == '\r') {
+        len--;
+        ending = EOL_CRLF;
+    }
+    *start = buf + off;
+    if (eol) *eol = ending;
+    return len;
+}
 
-    /*
-     * We are clearing one line at a time
-     * so do not need to clear the entire screen
-     * abAppend(&ab, "\x1b[2J", 4);
-     */
 
-    // "[2J" would leave the cursor at the end of screen, need to move
-    // it to the top left corner
-    abAppend(&ab, "\x1b[H", 3);
+/*** arena ***/
 
-    editorDrawRows(&ab);
+#define ARENA_CHUNK_MIN (64 * 1024)
 
-    // Mover cursor to the location pointed by co-ordinates
-    char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy-E.rowoff) + 1, (E.cx-E.coloff) + 1);
-    abAppend(&ab, buf, strlen(buf));
+/*
+ * Hand out len bytes, chunks double in size so a big file
+ * only ever needs a handful of them
+ */
+char* arenaAlloc(struct arena* a, size_t len) {
+    struct arenachunk* c = a->head;
 
-    // Display the cursor again as we are ready
-    abAppend(&ab, "\x1b[?25h", 6);
+    if (c == NULL || c->cap - c->used < len) {
+        size_t cap = c ? c->cap * 2 : ARENA_CHUNK_MIN;
+        while (cap < len) cap *= 2;
 
-    // Finally write the append buffer at once
-    write(STDOUT_FILENO, ab.b, ab.len);
-    abFree(&ab);
+        c = malloc(sizeof(struct arenachunk) + cap);
+        if (c == NULL) die("malloc");
+        c->next = a->head;
+        c->used = 0;
+        c->cap = cap;
+        a->head = c;
+    }
+
+    char* p = c->data + c->used;
+    c->used += len;
+    return p;
 }
 
+// Drop everything allocated from the arena at once
+void arenaRelease(struct arena* a) {
+    struct arenachunk* c = a->head;
+    while (c) {
+        struct arenachunk* next = c->next;
+        free(c);
+        c = next;
+    }
+    a->head = NULL;
+}
 
 
-/*** input ***/
+/*** row access ***/
 
-// Cursor Movement
-void editorMoveCursor(int key) {
-    erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+char* erowChars(erow* row) {
+    return row->storage == ROW_INLINE ? row->u.inl : row->u.chars;
+}
 
-    switch(key) {
-        case ARROW_LEFT:
-            if (E.cx != 0) {
-                E.cx--;
-            } else if (E.cy > 0) {
-                /* Allow the user to move to the end of prev line
-                 * when "<-" arrow is pressed
-                 */
-                E.cy--;
-                E.cx = E.row[E.cy].size;
-            }
-            break;
-        case ARROW_RIGHT:
-            if (row && E.cx < row->size) {
-                E.cx++;
-            } else if (row && E.cx == row->size) {
-                /* Allow the user to move to the start of the next line
-                 * when "->" arrow is pressed
-                 */
-                E.cy++;
-                E.cx = 0;
-            }
-            break;
-        case ARROW_UP:
-            if (E.cy != 0) {
-                E.cy--;
-            }
-            break;
-        case ARROW_DOWN:
-            if (E.cy < E.numrows) {
-                E.cy++;
-            }
-            break;
+// Point the row at bytes owned by somebody else
+void erowSetView(erow* row, char* s, ssize_t len) {
+    row->size = len;
+    row->storage = ROW_MAPPED;
+    row->enc = ENC_UNKNOWN;
+    row->u.chars = s;
+}
+
+// Copy s into the row itself if it fits, into the arena otherwise
+void erowSetCopy(erow* row, struct arena* a, const char* s, ssize_t len) {
+    char* dst;
+
+    if (len <= ROW_INLINE_MAX) {
+        row->storage = ROW_INLINE;
+        dst = row->u.inl;
+    } else {
+        row->storage = ROW_ARENA;
+        dst = row->u.chars = arenaAlloc(a, len + 1);
+    }
+    memcpy(dst, s, len);
+    dst[len] = '\0';
+    row->size = len;
+    row->enc = ENC_UNKNOWN;
+}
+
+// Settle the file's line ending style from how many rows use which
+void editorSetEolStyle(size_t lf, size_t crlf) {
+    if (crlf == 0) E.eolstyle = EOLS_LF;
+    else if (lf == 0) E.eolstyle = EOLS_CRLF;
+    else E.eolstyle = EOLS_MIXED;
+    E.neweol = crlf > lf ? EOL_CRLF : EOL_LF;
+}
+
+// Count endings for the backends that don't go through the line index
+void editorDetectEols(const char* buf, size_t len) {
+    const char* p = buf;
+    const char* end = buf + len;
+    size_t lf = 0, crlf = 0;
+
+    while (p < end && (p = memchr(p, '\n', end - p)) != NULL) {
+        if (p > buf && p[-1] == '\r') crlf++;
+        else lf++;
+        p++;
+    }
+    editorSetEolStyle(lf, crlf);
+}
+
+// What ends the rows we insert
+const char* editorNewline(size_t* len) {
+    *len = E.neweol == EOL_CRLF ? 2 : 1;
+    return E.neweol == EOL_CRLF ? "\r\n" : "\n";
+}
+
+
+/*** utf-8 ***/
+
+/*
+ * Tell ASCII, valid UTF-8 and anything else apart, ASCII with tabs
+ * counts as UTF-8 since its columns have to be counted too
+ *
+ * Runs of ASCII are skipped 16 bytes at a time with SSE2, each
+ * multibyte sequence is then checked byte by byte against the
+ * ranges of the Unicode well-formed table, which rules out
+ * overlong forms, surrogates and anything past U+10FFFF
+ */
+int utf8Classify(const char* buf, size_t len) {
+    const unsigned char* s = (const unsigned char*)buf;
+    size_t i = 0, k;
+    int ascii = 1;
+
+    while (i < len) {
+#ifdef KILO_SSE2
+        const __m128i tabs = _mm_set1_epi8('\t');
+        while (i + 16 <= len) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+            if (_mm_movemask_epi8(_mm_or_si128(v, _mm_cmpeq_epi8(v, tabs))))
+                break;
+            i += 16;
+        }
+        if (i == len) break;
+#endif
+        unsigned char c = s[i];
+        if (c < 0x80) {
+            // A tab takes more than one column
+            if (c == '\t') ascii = 0;
+            i++;
+            continue;
+        }
+
+        unsigned char lo = 0x80, hi = 0xBF;
+        size_t n;
+        if (c >= 0xC2 && c <= 0xDF) n = 1;
+        else if (c == 0xE0) n = 2, lo = 0xA0;
+        else if (c == 0xED) n = 2, hi = 0x9F;
+        else if (c >= 0xE1 && c <= 0xEF) n = 2;
+        else if (c == 0xF0) n = 3, lo = 0x90;
+        else if (c >= 0xF1 && c <= 0xF3) n = 3;
+        else if (c == 0xF4) n = 3, hi = 0x8F;
+        else return ENC_INVALID;
+
+        if (len - i <= n) return ENC_INVALID;
+        if (s[i+1] < lo || s[i+1] > hi) return ENC_INVALID;
+        for (k = 2; k <= n; k++)
+            if ((s[i+k] & 0xC0) != 0x80) return ENC_INVALID;
+        i += n + 1;
+        ascii = 0;
+    }
+    return ascii ? ENC_ASCII : ENC_UTF8;
+}
+
+int erowEncoding(erow* row) {
+    if (row->enc == ENC_UNKNOWN)
+        row->enc = utf8Classify(erowChars(row), row->size);
+    return row->enc;
+}
+
+#define UTF8_CONT(c) (((c) & 0xC0) == 0x80)
+
+// Start of the code point before byte `at`, just at - 1 off UTF-8 rows
+ssize_t erowPrevChar(erow* row, ssize_t at) {
+    if (at <= 0) return 0;
+    at--;
+    if (erowEncoding(row) != ENC_UTF8) return at;
+    char* c = erowChars(row);
+    while (at > 0 && UTF8_CONT(c[at])) at--;
+    return at;
+}
+
+ssize_t erowNextChar(erow* row, ssize_t at) {
+    if (at >= row->size) return row->size;
+    at++;
+    if (erowEncoding(row) != ENC_UTF8) return at;
+    char* c = erowChars(row);
+    while (at < row->size && UTF8_CONT(c[at])) at++;
+    return at;
+}
+
+// Move `at` back onto the start of the code point it falls in
+ssize_t erowCharStart(erow* row, ssize_t at) {
+    if (at >= row->size || erowEncoding(row) != ENC_UTF8) return at;
+    char* c = erowChars(row);
+    while (at > 0 && UTF8_CONT(c[at])) at--;
+    return at;
+}
+
+#define KILO_TAB_STOP 8
+
+// Code point of the n byte UTF-8 sequence at s
+wchar_t utf8Decode(const char* s, size_t n) {
+    const unsigned char* u = (const unsigned char*)s;
+    wchar_t cp = n == 1 ? u[0] : u[0] & (0x7F >> n);
+    size_t k;
+    for (k = 1; k < n; k++) cp = (cp << 6) | (u[k] & 0x3F);
+    return cp;
+}
+
+/*
+ * Columns the character s[0 .. n) takes when it starts at text
+ * column rx: a tab runs to the next tab stop, a UTF-8 code point
+ * takes what wcwidth() says (0 for combining marks, 2 for wide ones
+ * and -1 for ones that can't be printed), anything else one
+ */
+int editorCharWidth(const char* s, size_t n, ssize_t rx) {
+    if (s[0] == '\t') return KILO_TAB_STOP - rx % KILO_TAB_STOP;
+    if (n == 1) return 1;
+    return wcwidth(utf8Decode(s, n));
+}
+
+// Columns the character at byte `at` of a row takes, at least 0
+int erowCharWidth(erow* row, ssize_t at, ssize_t next, ssize_t rx) {
+    int w = editorCharWidth(erowChars(row) + at, next - at, rx);
+    return w < 0 ? 1 : w;
+}
+
+// Screen column of byte `cx`, counting tabs and wide characters
+ssize_t erowCxToRx(erow* row, ssize_t cx) {
+    if (erowEncoding(row) == ENC_ASCII) return cx;
+    ssize_t j = 0, rx = 0;
+    while (j < cx && j < row->size) {
+        ssize_t next = erowNextChar(row, j);
+        rx += erowCharWidth(row, j, next, rx);
+        j = next;
+    }
+    return rx;
+}
+
+// Byte of the character that covers screen column rx
+ssize_t erowRxToCx(erow* row, ssize_t rx) {
+    if (erowEncoding(row) == ENC_ASCII) return rx < row->size ? rx : row->size;
+    ssize_t cx = 0, col = 0;
+    while (cx < row->size) {
+        ssize_t next = erowNextChar(row, cx);
+        col += erowCharWidth(row, cx, next, col);
+        if (col > rx) break;
+        cx = next;
+    }
+    return cx;
+}
+
+
+/*** text tree ***/
+
+struct treenode* treeNewNode(const struct treeleaf* type, int leaf) {
+    struct treenode* n = calloc(1, leaf ? type->size : sizeof(struct treenode));
+    if (n == NULL) die("calloc");
+    n->leaf = leaf;
+    return n;
+}
+
+void treeFreeNode(const struct treeleaf* type, struct treenode* n) {
+    int j;
+    if (n == NULL) return;
+    if (!n->leaf)
+        for (j = 0; j < n->n; j++) treeFreeNode(type, n->child[j]);
+    else if (type->free)
+        type->free(n);
+    free(n);
+}
+
+// Refresh the totals of an inner node from its children
+void treeRecount(struct treenode* n) {
+    int j;
+
+    n->bytes = n->nls = 0;
+    for (j = 0; j < n->n; j++) {
+        n->bytes += n->child[j]->bytes;
+        n->nls += n->child[j]->nls;
+    }
+}
+
+void treeFree(struct tree* t) {
+    if (t->root) treeFreeNode(t->type, t->root);
+    free(t->line);
+    memset(t, 0, sizeof(*t));
+}
+
+// Same rows as the array backend: a trailing '\n' ends the last row
+void treeUpdateRows(struct tree* t) {
+    struct treenode* n = t->root;
+    size_t avail;
+
+    E.numrows = n->nls;
+    t->nextrow = -1;
+    if (n->bytes == 0) return;
+    while (!n->leaf) n = n->child[n->n - 1];
+    if (*t->type->text(n, n->bytes - 1, &avail) != '\n') E.numrows++;
+}
+
+/*
+ * Leaf holding byte pos, *off is the offset inside it and *nls the
+ * '\n's in the leaves before it. The end of the text is the end of
+ * the last leaf
+ */
+struct treenode* treeLeafAt(struct tree* t, size_t pos, size_t* off,
+        size_t* nls) {
+    struct treenode* n = t->root;
+    int j;
+
+    *nls = 0;
+    while (!n->leaf) {
+        for (j = 0; j < n->n - 1 && pos >= n->child[j]->bytes; j++) {
+            pos -= n->child[j]->bytes;
+            *nls += n->child[j]->nls;
+        }
+        n = n->child[j];
+    }
+    *off = pos;
+    return n;
+}
+
+/*
+ * Byte offset where row `at` starts, which is just past the at-th
+ * '\n': walk down on the newline counts, the leaf knows the rest
+ */
+size_t treeRowPos(struct tree* t, ssize_t at) {
+    struct treenode* n = t->root;
+    size_t k = at, base = 0;
+    int j;
+
+    if (at == 0) return 0;
+    if (at >= E.numrows) return n->bytes;
+
+    while (!n->leaf) {
+        for (j = 0; j < n->n - 1 && k > n->child[j]->nls; j++) {
+            k -= n->child[j]->nls;
+            base += n->child[j]->bytes;
+        }
+        n = n->child[j];
+    }
+    return base + t->type->rowpos(n, k);
+}
+
+// Row holding byte pos and the column of pos in it
+ssize_t treeRowForOffset(struct tree* t, size_t pos, ssize_t* col) {
+    size_t off, nls;
+    struct treenode* leaf = treeLeafAt(t, pos, &off, &nls);
+    ssize_t row = nls + t->type->newlines(leaf, off);
+
+    *col = pos - treeRowPos(t, row);
+    return row;
+}
+
+/*
+ * Row `at` as an erow, valid until the next call
+ * Rows inside one stretch of a leaf point straight at it, rows
+ * crossing leaves (or pieces) are joined in a scratch buffer.
+ * Drawing asks for rows in order, so carry on from where the last
+ * one ended
+ */
+erow* treeRow(struct tree* t, ssize_t at) {
+    size_t pos = (at == t->nextrow) ? t->nextpos : treeRowPos(t, at);
+    size_t joined = 0, total = t->root->bytes;
+    int found = 0;
+
+    erowSetView(&t->row, "", 0);
+
+    while (!found && pos < total) {
+        size_t off, nls, avail;
+        struct treenode* leaf = treeLeafAt(t, pos, &off, &nls);
+        char* s = t->type->text(leaf, off, &avail);
+        char* nl = memchr(s, '\n', avail);
+        size_t n = nl ? (size_t)(nl - s) : avail;
+
+        if (nl) found = 1;
+        if (!found || joined) {
+            if (joined + n > t->linecap) {
+                t->linecap = (joined + n) * 2;
+                t->line = realloc(t->line, t->linecap);
+                if (t->line == NULL) die("realloc");
+            }
+            memcpy(t->line + joined, s, n);
+            joined += n;
+            erowSetView(&t->row, t->line, joined);
+        } else {
+            erowSetView(&t->row, s, n);
+        }
+        pos += n + found;
+    }
+
+    if (found && t->row.size > 0 && t->row.u.chars[t->row.size-1] == '\r')
+        t->row.size--;
+    t->nextrow = at + 1;
+    t->nextpos = pos;
+    return &t->row;
+}
+
+/*
+ * Insert into the subtree below n, in the leaf pos falls in (the
+ * left one on a boundary). Returns a new right sibling when n had
+ * to be split, which the caller adds next to n
+ */
+struct treenode* treeInsertNode(struct tree* t, struct treenode* n,
+        size_t pos, const void* what, size_t len) {
+    int j;
+
+    if (n->leaf) return t->type->insert(n, pos, what, len);
+
+    for (j = 0; j < n->n - 1 && pos > n->child[j]->bytes; j++)
+        pos -= n->child[j]->bytes;
+
+    struct treenode* split = treeInsertNode(t, n->child[j], pos, what, len);
+    if (split) {
+        memmove(&n->child[j+2], &n->child[j+1],
+                sizeof(struct treenode*) * (n->n - j - 1));
+        n->child[j+1] = split;
+        n->n++;
+    }
+
+    struct treenode* right = NULL;
+    if (n->n > TREE_FANOUT) {
+        right = treeNewNode(t->type, 0);
+        right->n = n->n / 2;
+        n->n -= right->n;
+        memcpy(right->child, &n->child[n->n],
+                sizeof(struct treenode*) * right->n);
+        treeRecount(right);
+    }
+    treeRecount(n);
+    return right;
+}
+
+// Insert at byte offset pos, growing a new root when the old one split
+void treeInsert(struct tree* t, size_t pos, const void* what, size_t len) {
+    struct treenode* split = treeInsertNode(t, t->root, pos, what, len);
+
+    if (split) {
+        struct treenode* root = treeNewNode(t->type, 0);
+        root->child[0] = t->root;
+        root->child[1] = split;
+        root->n = 2;
+        treeRecount(root);
+        t->root = root;
+    }
+}
+
+// Remove [pos, pos + len) below n, dropping nodes that end up empty
+void treeDeleteNode(struct tree* t, struct treenode* n, size_t pos,
+        size_t len) {
+    int j;
+
+    if (n->leaf) {
+        t->type->remove(n, pos, len);
+        return;
+    }
+
+    for (j = 0; j < n->n && len > 0; j++) {
+        struct treenode* c = n->child[j];
+        if (pos >= c->bytes) {
+            pos -= c->bytes;
+            continue;
+        }
+
+        size_t d = c->bytes - pos < len ? c->bytes - pos : len;
+        treeDeleteNode(t, c, pos, d);
+        len -= d;
+        pos = 0;
+        if (c->bytes == 0) {
+            treeFreeNode(t->type, c);
+            memmove(&n->child[j], &n->child[j+1],
+                    sizeof(struct treenode*) * (n->n - j - 1));
+            n->n--;
+            j--;
+        }
+    }
+    treeRecount(n);
+}
+
+void treeDelete(struct tree* t, size_t pos, size_t len) {
+    treeDeleteNode(t, t->root, pos, len);
+
+    // Don't leave a chain of single children (or nothing) at the top
+    while (!t->root->leaf && t->root->n <= 1) {
+        struct treenode* old = t->root;
+        t->root = old->n ? old->child[0] : treeNewNode(t->type, 1);
+        free(old);
+    }
+}
+
+// Write the text below n in order
+void treeWriteNode(struct tree* t, FILE* fp, struct treenode* n) {
+    size_t off = 0, avail;
+    int j;
+
+    if (!n->leaf) {
+        for (j = 0; j < n->n; j++) treeWriteNode(t, fp, n->child[j]);
+        return;
+    }
+    while (off < n->bytes) {
+        char* s = t->type->text(n, off, &avail);
+        fwrite(s, 1, avail, fp);
+        off += avail;
+    }
+}
+
+
+/*** piece table ***/
+
+#define PT_ORIG 0
+#define PT_ADD 1
+
+// How many '\n' bytes are in b->data[0 .. off)
+size_t ptNewlinesBefore(struct ptbuffer* b, size_t off) {
+    size_t lo = 0, hi = b->nl.len;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (b->nl.offs[mid] <= off) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+size_t ptNewlinesIn(struct piece* p) {
+    struct ptbuffer* b = &E.pt.buf[p->buf];
+    return ptNewlinesBefore(b, p->start + p->len) -
+        ptNewlinesBefore(b, p->start);
+}
+
+struct ptleaf* ptLeaf(struct treenode* n) {
+    return (struct ptleaf*)n;
+}
+
+// Refresh the totals of a leaf from its pieces
+void ptRecount(struct treenode* n) {
+    struct ptleaf* l = ptLeaf(n);
+    int j;
+
+    n->bytes = n->nls = 0;
+    for (j = 0; j < n->n; j++) {
+        n->bytes += l->pieces[j].len;
+        n->nls += l->pieces[j].nls;
+    }
+}
+
+// The rest of the piece leaf offset off falls in
+char* ptLeafText(struct treenode* n, size_t off, size_t* avail) {
+    struct ptleaf* l = ptLeaf(n);
+    int j;
+
+    for (j = 0; j < n->n - 1 && off >= l->pieces[j].len; j++)
+        off -= l->pieces[j].len;
+    struct piece* p = &l->pieces[j];
+    *avail = p->len - off;
+    return E.pt.buf[p->buf].data + p->start + off;
+}
+
+// Find the piece holding the k-th '\n', then its buffer knows where it is
+size_t ptLeafRowPos(struct treenode* n, size_t k) {
+    struct ptleaf* l = ptLeaf(n);
+    size_t base = 0;
+    int j;
+
+    for (j = 0; j < n->n - 1 && k > l->pieces[j].nls; j++) {
+        k -= l->pieces[j].nls;
+        base += l->pieces[j].len;
+    }
+
+    struct piece* p = &l->pieces[j];
+    struct ptbuffer* b = &E.pt.buf[p->buf];
+    size_t nth = ptNewlinesBefore(b, p->start) + k - 1;
+    return base + b->nl.offs[nth] - p->start;
+}
+
+size_t ptLeafNewlines(struct treenode* n, size_t off) {
+    struct ptleaf* l = ptLeaf(n);
+    size_t nls = 0;
+    int j;
+
+    for (j = 0; j < n->n && off >= l->pieces[j].len; j++) {
+        off -= l->pieces[j].len;
+        nls += l->pieces[j].nls;
+    }
+    if (j < n->n) {
+        struct piece* p = &l->pieces[j];
+        struct ptbuffer* b = &E.pt.buf[p->buf];
+        nls += ptNewlinesBefore(b, p->start + off) -
+            ptNewlinesBefore(b, p->start);
+    }
+    return nls;
+}
+
+/*
+ * Make a piece start at off, cutting the one off falls in, and put
+ * the piece `what` there when one is given (growing the piece before
+ * it instead when it carries straight on from it in the same buffer)
+ */
+struct treenode* ptLeafInsert(struct treenode* n, size_t off,
+        const void* what, size_t len) {
+    struct ptleaf* l = ptLeaf(n);
+    const struct piece* p = what;
+    int j;
+    (void)len; // The piece knows
+
+    for (j = 0; j < n->n && off >= l->pieces[j].len; j++)
+        off -= l->pieces[j].len;
+
+    if (off > 0) {
+        memmove(&l->pieces[j+1], &l->pieces[j],
+                sizeof(struct piece) * (n->n - j));
+        n->n++;
+        struct piece* left = &l->pieces[j];
+        struct piece* rest = &l->pieces[j+1];
+        left->len = off;
+        rest->start += off;
+        rest->len -= off;
+        left->nls = ptNewlinesIn(left);
+        rest->nls -= left->nls;
+        j++;
+    }
+
+    struct piece* prev = j > 0 ? &l->pieces[j-1] : NULL;
+    if (p && prev && prev->buf == p->buf && prev->start + prev->len == p->start) {
+        prev->len += p->len;
+        prev->nls += p->nls;
+    } else if (p) {
+        memmove(&l->pieces[j+1], &l->pieces[j],
+                sizeof(struct piece) * (n->n - j));
+        l->pieces[j] = *p;
+        n->n++;
+    }
+
+    struct treenode* right = NULL;
+    if (n->n > PT_LEAF_MAX) {
+        right = treeNewNode(E.pt.tree.type, 1);
+        right->n = n->n / 2;
+        n->n -= right->n;
+        memcpy(ptLeaf(right)->pieces, &l->pieces[n->n],
+                sizeof(struct piece) * right->n);
+        ptRecount(right);
+    }
+    ptRecount(n);
+    return right;
+}
+
+// Drop the pieces making up [off, off + len), which starts and ends between two
+void ptLeafRemove(struct treenode* n, size_t off, size_t len) {
+    struct ptleaf* l = ptLeaf(n);
+    int j, k;
+
+    for (j = 0; off > 0; j++) off -= l->pieces[j].len;
+    for (k = j; len > 0; k++) len -= l->pieces[k].len;
+    memmove(&l->pieces[j], &l->pieces[k],
+            sizeof(struct piece) * (n->n - k));
+    n->n -= k - j;
+    ptRecount(n);
+}
+
+const struct treeleaf ptLeafType = {
+    sizeof(struct ptleaf), ptLeafText, ptLeafRowPos, ptLeafNewlines,
+    ptLeafInsert, ptLeafRemove, NULL
+};
+
+// Start a piece table over the file image
+void ptLoad(char* buf, size_t len) {
+    struct piecetable* pt = &E.pt;
+
+    pt->buf[PT_ORIG].data = buf;
+    pt->buf[PT_ORIG].len = pt->buf[PT_ORIG].cap = len;
+    lineIndexScanner()(&pt->buf[PT_ORIG].nl, buf, len);
+
+    pt->tree.type = &ptLeafType;
+    pt->tree.root = treeNewNode(&ptLeafType, 1);
+    if (len > 0) {
+        struct ptleaf* l = ptLeaf(pt->tree.root);
+        l->pieces[0].buf = PT_ORIG;
+        l->pieces[0].start = 0;
+        l->pieces[0].len = len;
+        l->pieces[0].nls = pt->buf[PT_ORIG].nl.len;
+        l->t.n = 1;
+        ptRecount(&l->t);
+    }
+    treeUpdateRows(&pt->tree);
+}
+
+void ptFree() {
+    struct piecetable* pt = &E.pt;
+    int j;
+
+    free(pt->buf[PT_ADD].data);
+    for (j = 0; j < 2; j++) {
+        lineIndexFree(&pt->buf[j].nl);
+        pt->buf[j].data = NULL;
+        pt->buf[j].len = pt->buf[j].cap = 0;
+    }
+    treeFree(&pt->tree);
+}
+
+/*
+ * Insert len bytes at document offset pos
+ * The text goes to the end of the add buffer; typing at the end of
+ * the last inserted piece just grows that piece
+ */
+void ptInsert(size_t pos, const char* s, size_t len) {
+    struct piecetable* pt = &E.pt;
+    struct ptbuffer* add = &pt->buf[PT_ADD];
+    struct piece p = {PT_ADD, add->len, len, 0};
+    size_t j;
+
+    if (len == 0) return;
+
+    if (add->len + len > add->cap) {
+        add->cap = (add->len + len) * 2;
+        add->data = realloc(add->data, add->cap);
+        if (add->data == NULL) die("realloc");
+    }
+    memcpy(add->data + p.start, s, len);
+    add->len += len;
+    for (j = 0; j < len; j++) {
+        if (s[j] == '\n') {
+            lineIndexPush(&add->nl, p.start + j + 1);
+            p.nls++;
+        }
+    }
+
+    treeInsert(&pt->tree, pos, &p, len);
+    treeUpdateRows(&pt->tree);
+}
+
+/*
+ * Remove len bytes starting at document offset pos: cut pieces at
+ * both ends so the range is made of whole pieces, then drop those
+ */
+void ptDelete(size_t pos, size_t len) {
+    struct piecetable* pt = &E.pt;
+
+    if (len == 0) return;
+    treeInsert(&pt->tree, pos, NULL, 0);
+    treeInsert(&pt->tree, pos + len, NULL, 0);
+    treeDelete(&pt->tree, pos, len);
+    treeUpdateRows(&pt->tree);
+}
+
+
+/*** rope ***/
+
+struct ropeleaf* ropeLeaf(struct treenode* n) {
+    return (struct ropeleaf*)n;
+}
+
+// Refresh the totals of a leaf from its text
+void ropeRecount(struct treenode* n) {
+    struct ropeleaf* l = ropeLeaf(n);
+    size_t i;
+
+    n->nls = 0;
+    for (i = 0; i < n->bytes; i++)
+        if (l->text[i] == '\n') n->nls++;
+}
+
+// Give a leaf its own writable copy of the text
+void ropeLeafMakeOwned(struct ropeleaf* l) {
+    if (l->owned) return;
+    char* text = malloc(ROPE_LEAF_MAX);
+    if (text == NULL) die("malloc");
+    if (l->t.bytes) memcpy(text, l->text, l->t.bytes);
+    l->text = text;
+    l->owned = 1;
+}
+
+char* ropeLeafText(struct treenode* n, size_t off, size_t* avail) {
+    *avail = n->bytes - off;
+    return ropeLeaf(n)->text + off;
+}
+
+size_t ropeLeafRowPos(struct treenode* n, size_t k) {
+    char* text = ropeLeaf(n)->text;
+    char* p = text;
+    while (k--) p = (char*)memchr(p, '\n', text + n->bytes - p) + 1;
+    return p - text;
+}
+
+size_t ropeLeafNewlines(struct treenode* n, size_t off) {
+    char* text = ropeLeaf(n)->text;
+    size_t j, nls = 0;
+    for (j = 0; j < off && j < n->bytes; j++)
+        if (text[j] == '\n') nls++;
+    return nls;
+}
+
+// Put the len bytes at `what` into the leaf, cutting it in half when full
+struct treenode* ropeLeafInsert(struct treenode* n, size_t off,
+        const void* what, size_t len) {
+    struct ropeleaf* l = ropeLeaf(n);
+    const char* s = what;
+
+    ropeLeafMakeOwned(l);
+    if (n->bytes + len <= ROPE_LEAF_MAX) {
+        memmove(l->text + off + len, l->text + off, n->bytes - off);
+        memcpy(l->text + off, s, len);
+        n->bytes += len;
+        ropeRecount(n);
+        return NULL;
+    }
+
+    // Overflow: lay out the combined text and cut it in half
+    char tmp[ROPE_LEAF_MAX * 2];
+    size_t total = n->bytes + len;
+    memcpy(tmp, l->text, off);
+    memcpy(tmp + off, s, len);
+    memcpy(tmp + off + len, l->text + off, n->bytes - off);
+
+    struct ropeleaf* right = ropeLeaf(treeNewNode(E.rope.tree.type, 1));
+    ropeLeafMakeOwned(right);
+    n->bytes = total / 2;
+    right->t.bytes = total - n->bytes;
+    memcpy(l->text, tmp, n->bytes);
+    memcpy(right->text, tmp + n->bytes, right->t.bytes);
+    ropeRecount(n);
+    ropeRecount(&right->t);
+    return &right->t;
+}
+
+void ropeLeafRemove(struct treenode* n, size_t off, size_t len) {
+    struct ropeleaf* l = ropeLeaf(n);
+
+    ropeLeafMakeOwned(l);
+    memmove(l->text + off, l->text + off + len, n->bytes - off - len);
+    n->bytes -= len;
+    ropeRecount(n);
+}
+
+void ropeLeafFree(struct treenode* n) {
+    struct ropeleaf* l = ropeLeaf(n);
+    if (l->owned) free(l->text);
+}
+
+const struct treeleaf ropeLeafType = {
+    sizeof(struct ropeleaf), ropeLeafText, ropeLeafRowPos, ropeLeafNewlines,
+    ropeLeafInsert, ropeLeafRemove, ropeLeafFree
+};
+
+/*
+ * Build the tree bottom up: full leaves over the file image,
+ * then levels of TREE_FANOUT nodes until one root is left
+ */
+void ropeLoad(char* buf, size_t len) {
+    struct rope* r = &E.rope;
+    size_t nleaves = (len + ROPE_LEAF_MAX - 1) / ROPE_LEAF_MAX;
+    size_t i, j;
+
+    r->orig = buf;
+    r->tree.type = &ropeLeafType;
+    if (nleaves == 0) {
+        r->tree.root = treeNewNode(&ropeLeafType, 1);
+        treeUpdateRows(&r->tree);
+        return;
+    }
+
+    struct treenode** level = malloc(sizeof(struct treenode*) * nleaves);
+    if (level == NULL) die("malloc");
+    for (i = 0; i < nleaves; i++) {
+        struct ropeleaf* l = ropeLeaf(treeNewNode(&ropeLeafType, 1));
+        l->text = buf + i * ROPE_LEAF_MAX;
+        l->t.bytes = len - i * ROPE_LEAF_MAX;
+        if (l->t.bytes > ROPE_LEAF_MAX) l->t.bytes = ROPE_LEAF_MAX;
+        ropeRecount(&l->t);
+        level[i] = &l->t;
+    }
+
+    size_t count = nleaves;
+    while (count > 1) {
+        size_t parents = (count + TREE_FANOUT - 1) / TREE_FANOUT;
+        for (i = 0; i < parents; i++) {
+            struct treenode* n = treeNewNode(&ropeLeafType, 0);
+            for (j = i * TREE_FANOUT; j < count && j < (i+1) * TREE_FANOUT; j++)
+                n->child[n->n++] = level[j];
+            treeRecount(n);
+            level[i] = n;
+        }
+        count = parents;
+    }
+    r->tree.root = level[0];
+    free(level);
+    treeUpdateRows(&r->tree);
+}
+
+void ropeFree() {
+    treeFree(&E.rope.tree);
+    E.rope.orig = NULL;
+}
+
+/*
+ * Insert len bytes at byte offset pos
+ * Long text goes in leaf sized steps so a split never has to
+ * deal with more than one extra leaf
+ */
+void ropeInsert(size_t pos, const char* s, size_t len) {
+    while (len > 0) {
+        size_t n = len > ROPE_LEAF_MAX / 2 ? ROPE_LEAF_MAX / 2 : len;
+        treeInsert(&E.rope.tree, pos, s, n);
+        pos += n;
+        s += n;
+        len -= n;
+    }
+    treeUpdateRows(&E.rope.tree);
+}
+
+void ropeDelete(size_t pos, size_t len) {
+    if (len == 0) return;
+    treeDelete(&E.rope.tree, pos, len);
+    treeUpdateRows(&E.rope.tree);
+}
+
+
+/*** gzip stream ***/
+
+/*
+ * gzip files start with 1f 8b. Bare zlib streams (78 ..) aren't
+ * recognized, they're shown as they are
+ */
+int gzIsCompressed(int fd) {
+    unsigned char magic[2];
+    return pread(fd, magic, 2, 0) == 2 && magic[0] == 0x1f && magic[1] == 0x8b;
+}
+
+void gzPublish(struct gzstream* gz, size_t avail, int done) {
+    pthread_mutex_lock(&gz->lock);
+    gz->avail = avail;
+    gz->done = done;
+    pthread_cond_broadcast(&gz->more);
+    pthread_mutex_unlock(&gz->lock);
+}
+
+/*
+ * Inflate the whole file, committing memory in the reservation as
+ * the output grows. Concatenated members (as from cat a.gz b.gz)
+ * are inflated one after another like gzip -d does
+ */
+void* gzMain(void* arg) {
+    struct gzstream* gz = arg;
+    unsigned char* in = malloc(GZ_INPUT);
+    size_t produced = 0;
+    int ret = Z_OK, inmember = 0, members = 0;
+    z_stream zs;
+
+    memset(&zs, 0, sizeof(zs));
+    if (in == NULL || inflateInit2(&zs, 15 + 32) != Z_OK) {
+        __atomic_store_n(&gz->error, 1, __ATOMIC_RELAXED);
+        gzPublish(gz, 0, 1);
+        free(in);
+        return NULL;
+    }
+
+    while (!__atomic_load_n(&gz->stop, __ATOMIC_RELAXED)) {
+        if (zs.avail_in == 0) {
+            ssize_t n = read(gz->fd, in, GZ_INPUT);
+            if (n == -1 && errno == EINTR) continue;
+            if (n <= 0) break;
+            zs.next_in = in;
+            zs.avail_in = n;
+            __atomic_add_fetch(&gz->consumed, n, __ATOMIC_RELAXED);
+        }
+
+        if (produced == gz->committed) {
+            if (gz->committed + GZ_COMMIT > gz->reserve ||
+                    mprotect(gz->image + gz->committed, GZ_COMMIT,
+                        PROT_READ | PROT_WRITE) == -1) {
+                // Out of room, show what we have
+                __atomic_store_n(&gz->error, 1, __ATOMIC_RELAXED);
+                inmember = 0;
+                break;
+            }
+            gz->committed += GZ_COMMIT;
+        }
+
+        zs.next_out = (unsigned char*)gz->image + produced;
+        zs.avail_out = gz->committed - produced;
+        ret = inflate(&zs, Z_NO_FLUSH);
+        produced = (char*)zs.next_out - gz->image;
+        inmember = 1;
+
+        if (ret == Z_STREAM_END) {
+            inflateReset(&zs);
+            inmember = 0;
+            members++;
+        } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            // Garbage after a complete member is ignored, like gzip does
+            if (members == 0 || zs.total_out > 0)
+                __atomic_store_n(&gz->error, 1, __ATOMIC_RELAXED);
+            inmember = 0;
+            break;
+        }
+        gzPublish(gz, produced, 0);
+    }
+    if (inmember) __atomic_store_n(&gz->error, 1, __ATOMIC_RELAXED);
+
+    inflateEnd(&zs);
+    free(in);
+    close(gz->fd);
+    gzPublish(gz, produced, 1);
+    return NULL;
+}
+
+/*
+ * Start inflating fd (which the stream now owns), the text shows up
+ * in E.filemap as the loader indexes it
+ */
+void gzOpen(int fd, off_t insize) {
+    struct gzstream* gz = &E.gz;
+    size_t reserve = GZ_RESERVE;
+    char* image = MAP_FAILED;
+
+    // PROT_NONE address space costs no memory, just find a size we get
+    while (reserve >= GZ_COMMIT) {
+        image = mmap(NULL, reserve, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (image != MAP_FAILED) break;
+        reserve /= 2;
+    }
+    if (image == MAP_FAILED) die("mmap");
+
+    memset(gz, 0, sizeof(*gz));
+    gz->fd = fd;
+    gz->image = image;
+    gz->reserve = reserve;
+    gz->insize = insize;
+    pthread_mutex_init(&gz->lock, NULL);
+    pthread_cond_init(&gz->more, NULL);
+    if (pthread_create(&gz->thread, NULL, gzMain, gz) != 0)
+        die("pthread_create");
+    gz->running = 1;
+
+    E.filemap = image;
+    E.filemapsize = 0;
+}
+
+// After the loader is stopped: join the thread, drop the image
+void gzClose() {
+    struct gzstream* gz = &E.gz;
+
+    if (!gz->running) return;
+    __atomic_store_n(&gz->stop, 1, __ATOMIC_RELAXED);
+    pthread_join(gz->thread, NULL);
+    pthread_mutex_destroy(&gz->lock);
+    pthread_cond_destroy(&gz->more);
+    munmap(gz->image, gz->reserve);
+    gz->running = 0;
+
+    E.filemap = NULL;
+    E.filemapsize = 0;
+}
+
+
+/*** background loader ***/
+
+// Append one offset, moving to a bigger array instead of realloc()
+void loaderPush(struct loader* ld, size_t off) {
+    if (ld->len == ld->cap) {
+        size_t cap = ld->cap ? ld->cap * 2 : 64 * 1024;
+        size_t* offs = malloc(sizeof(size_t) * cap);
+        if (offs == NULL) die("malloc");
+        if (ld->len) memcpy(offs, ld->offs, sizeof(size_t) * ld->len);
+
+        if (ld->offs) {
+            if (ld->nretired == LOADER_MAX_RETIRED) die("loader");
+            ld->retired[ld->nretired++] = ld->offs;
+        }
+        __atomic_store_n(&ld->offs, offs, __ATOMIC_RELEASE);
+        ld->cap = cap;
+    }
+    ld->offs[ld->len++] = off;
+}
+
+/*
+ * How much text there is to index past `scanned`, waiting for the
+ * gzip thread to inflate more if it isn't finished. *final is set
+ * once no more text will come
+ */
+size_t loaderInput(struct loader* ld, size_t scanned, int* final) {
+    struct gzstream* gz = ld->src;
+    size_t avail;
+
+    if (gz == NULL) {
+        *final = 1;
+        return E.filemapsize;
+    }
+    pthread_mutex_lock(&gz->lock);
+    while (gz->avail == scanned && !gz->done &&
+            !__atomic_load_n(&ld->stop, __ATOMIC_RELAXED))
+        pthread_cond_wait(&gz->more, &gz->lock);
+    avail = gz->avail;
+    *final = gz->done;
+    pthread_mutex_unlock(&gz->lock);
+    return avail;
+}
+
+/*
+ * Index the file a chunk at a time, publishing the new line
+ * count after every chunk
+ */
+void* loaderMain(void* arg) {
+    struct loader* ld = arg;
+    struct lineindex chunk = {NULL, 0, 0};
+    lineIndexScanFn scan = lineIndexScanner();
+    const char* buf = E.filemap;
+    size_t scanned = 0, j;
+    int final = 0;
+
+    loaderPush(ld, 0);
+    while (!__atomic_load_n(&ld->stop, __ATOMIC_RELAXED)) {
+        size_t len = loaderInput(ld, scanned, &final);
+
+        if (scanned < len) {
+            size_t n = len - scanned < LAZY_INDEX_CHUNK ? len - scanned : LAZY_INDEX_CHUNK;
+            chunk.len = 0;
+            scan(&chunk, buf + scanned, n);
+            for (j = 0; j < chunk.len; j++) loaderPush(ld, chunk.offs[j] + scanned);
+            scanned += n;
+        }
+
+        int last = final && scanned == len;
+        if (last && len > 0 && buf[len-1] != '\n') loaderPush(ld, len + 1);
+        __atomic_store_n(&ld->count, ld->len, __ATOMIC_RELEASE);
+        __atomic_store_n(&ld->scanned, scanned, __ATOMIC_RELAXED);
+        if (last) break;
+    }
+    lineIndexFree(&chunk);
+    __atomic_store_n(&ld->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+void loaderStart() {
+    struct loader* ld = &E.loader;
+
+    memset(ld, 0, sizeof(*ld));
+    if (E.gz.running) ld->src = &E.gz;
+    if (pthread_create(&ld->thread, NULL, loaderMain, ld) != 0)
+        die("pthread_create");
+    ld->running = 1;
+}
+
+/*
+ * Pick up whatever the loader published, E.index becomes a
+ * read-only view of its array until the thread is done. Then the
+ * array is handed over to E.index for good
+ */
+void loaderPoll() {
+    struct loader* ld = &E.loader;
+    int done = __atomic_load_n(&ld->done, __ATOMIC_ACQUIRE);
+    size_t count = __atomic_load_n(&ld->count, __ATOMIC_ACQUIRE);
+
+    E.index.offs = __atomic_load_n(&ld->offs, __ATOMIC_ACQUIRE);
+    E.index.len = count;
+    E.index.cap = 0;
+    E.numrows = lineIndexCount(&E.index);
+    E.indexed = __atomic_load_n(&ld->scanned, __ATOMIC_RELAXED);
+    // Inflated text only counts once it is indexed
+    if (ld->src) E.filemapsize = E.indexed;
+    if (!done) return;
+
+    pthread_join(ld->thread, NULL);
+    while (ld->nretired) free(ld->retired[--ld->nretired]);
+    E.index.cap = ld->cap;
+    E.indexdone = 1;
+    ld->running = 0;
+}
+
+// Stop a load in progress (opening another file, freeing the rows)
+void loaderStop() {
+    struct loader* ld = &E.loader;
+
+    if (!ld->running) return;
+    __atomic_store_n(&ld->stop, 1, __ATOMIC_RELAXED);
+    if (ld->src) {
+        // It may be waiting for more text
+        pthread_mutex_lock(&ld->src->lock);
+        pthread_cond_broadcast(&ld->src->more);
+        pthread_mutex_unlock(&ld->src->lock);
+    }
+    pthread_join(ld->thread, NULL);
+    while (ld->nretired) free(ld->retired[--ld->nretired]);
+    free(ld->offs);
+    ld->running = 0;
+
+    E.index.offs = NULL;
+    E.index.len = E.index.cap = 0;
+}
+
+
+/*** cold store ***/
+
+/*
+ * A small LZ77 codec in the style of LZ4: a block is a run of
+ * sequences, each a token (literal count in the high nibble, match
+ * length - 4 in the low one, 15 meaning more bytes follow), the
+ * literals, and a 2 byte offset back to the match. The last
+ * sequence has literals only. Blocks are at most 64KB so offsets
+ * always fit
+ */
+static unsigned coldRead32(const unsigned char* p) {
+    unsigned v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static unsigned char* coldPutLength(unsigned char* op, size_t n) {
+    for (; n >= 255; n -= 255) *op++ = 255;
+    *op++ = n;
+    return op;
+}
+
+// Bound on the compressed size of len bytes
+size_t coldBound(size_t len) {
+    return len + len / 255 + 16;
+}
+
+size_t coldCompress(const char* in, size_t len, char* out) {
+    const unsigned char* src = (const unsigned char*)in;
+    unsigned char* op = (unsigned char*)out;
+    int table[1 << COLD_HASH_BITS];
+    size_t i = 0, anchor = 0;
+
+    memset(table, -1, sizeof(table));
+    while (len >= 4 && i + 4 <= len) {
+        unsigned seq = coldRead32(src + i);
+        unsigned h = (seq * 2654435761u) >> (32 - COLD_HASH_BITS);
+        int ref = table[h];
+        table[h] = i;
+
+        if (ref < 0 || i - ref > 65535 || coldRead32(src + ref) != seq) {
+            // Skip faster through stretches that don't compress
+            i += 1 + ((i - anchor) >> 6);
+            continue;
+        }
+
+        size_t m = 4, lit = i - anchor;
+        while (i + m < len && src[ref + m] == src[i + m]) m++;
+
+        unsigned char* token = op++;
+        *token = (lit < 15 ? lit : 15) << 4 | (m - 4 < 15 ? m - 4 : 15);
+        if (lit >= 15) op = coldPutLength(op, lit - 15);
+        memcpy(op, src + anchor, lit);
+        op += lit;
+        *op++ = (i - ref) & 0xff;
+        *op++ = (i - ref) >> 8;
+        if (m - 4 >= 15) op = coldPutLength(op, m - 4 - 15);
+
+        i += m;
+        anchor = i;
+    }
+
+    size_t lit = len - anchor;
+    *op++ = (lit < 15 ? lit : 15) << 4;
+    if (lit >= 15) op = coldPutLength(op, lit - 15);
+    memcpy(op, src + anchor, lit);
+    op += lit;
+    return op - (unsigned char*)out;
+}
+
+// Returns the decompressed size, which the caller knows already
+size_t coldDecompress(const char* in, size_t clen, char* out, size_t cap) {
+    const unsigned char* ip = (const unsigned char*)in;
+    const unsigned char* iend = ip + clen;
+    unsigned char* op = (unsigned char*)out;
+    unsigned char* oend = op + cap;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t lit = token >> 4, m = (token & 15) + 4;
+        unsigned b;
+
+        if (lit == 15) do { b = *ip++; lit += b; } while (b == 255);
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) die("cold store");
+        memcpy(op, ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == iend) break;
+
+        size_t off = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (m == 19) do { b = *ip++; m += b; } while (b == 255);
+        if (off == 0 || off > (size_t)(op - (unsigned char*)out) ||
+                m > (size_t)(oend - op))
+            die("cold store");
+
+        // Matches may overlap what they copy, go a byte at a time then
+        const unsigned char* ref = op - off;
+        if (off >= m) {
+            memcpy(op, ref, m);
+            op += m;
+        } else {
+            while (m--) *op++ = *ref++;
+        }
+    }
+    return op - (unsigned char*)out;
+}
+
+// Compress the text a pager page at a time
+void coldBuild(struct coldstore* cs, const char* buf, size_t len) {
+    char* tmp = malloc(coldBound(PAGER_PAGE));
+    size_t j;
+
+    cs->nblocks = (len + PAGER_PAGE - 1) / PAGER_PAGE;
+    cs->blocks = malloc(sizeof(struct coldblock) * (cs->nblocks + 1));
+    cs->bytes = 0;
+    if (tmp == NULL || cs->blocks == NULL) die("malloc");
+
+    for (j = 0; j < cs->nblocks; j++) {
+        const char* src = buf + j * PAGER_PAGE;
+        size_t n = len - j * PAGER_PAGE < PAGER_PAGE ? len - j * PAGER_PAGE : PAGER_PAGE;
+        size_t clen = coldCompress(src, n, tmp);
+        struct coldblock* b = &cs->blocks[j];
+
+        if (clen >= n) {
+            clen = n;
+            b->clen = -1;
+        } else {
+            b->clen = clen;
+            src = tmp;
+        }
+        b->data = malloc(clen);
+        if (b->data == NULL) die("malloc");
+        memcpy(b->data, src, clen);
+        cs->bytes += clen;
+    }
+    free(tmp);
+}
+
+void coldFree(struct coldstore* cs) {
+    size_t j;
+    for (j = 0; j < cs->nblocks; j++) free(cs->blocks[j].data);
+    free(cs->blocks);
+    memset(cs, 0, sizeof(*cs));
+}
+
+// Decompress block j into a pager page, returns its length
+size_t coldLoad(struct coldstore* cs, size_t j, char* page, size_t len) {
+    struct coldblock* b = &cs->blocks[j];
+    if (b->clen < 0) {
+        memcpy(page, b->data, len);
+        return len;
+    }
+    return coldDecompress(b->data, b->clen, page, len);
+}
+
+
+/*** pager ***/
+
+void pagerOpen(int fd, off_t size) {
+    struct pager* p = &E.pager;
+    int j;
+
+    memset(p, 0, sizeof(*p));
+    p->fd = fd;
+    p->size = size;
+
+    // The pages are the budget, the checkpoints are noise next to them
+    p->npages = (E.pagerbudget - PAGER_MAXLINE) / PAGER_PAGE;
+    if (p->npages < 4) p->npages = 4;
+    // Zeroed, the LRU in pagerGet() compares when each slot was used
+    p->pages = calloc(p->npages, sizeof(struct pagerpage));
+    if (p->pages == NULL) die("calloc");
+    for (j = 0; j < p->npages; j++) p->pages[j].off = -1;
+
+    p->checkcap = 64;
+    p->checkpoints = malloc(sizeof(off_t) * p->checkcap);
+    if (p->checkpoints == NULL) die("malloc");
+    p->checkpoints[0] = 0;
+    p->ncheckpoints = 1;
+
+    p->line = malloc(PAGER_MAXLINE);
+    if (p->line == NULL) die("malloc");
+}
+
+/*
+ * Page the file image through a cold store instead of the file,
+ * the image itself is let go once it is compressed
+ */
+void pagerOpenCold(const char* buf, size_t len) {
+    pagerOpen(-1, len);
+    E.pager.npages = COLD_CACHE < E.pager.npages ? COLD_CACHE : E.pager.npages;
+    coldBuild(&E.pager.cold, buf, len);
+}
+
+void pagerClose() {
+    struct pager* p = &E.pager;
+    int j;
+
+    if (p->pages == NULL) return;
+    for (j = 0; j < p->npages; j++) free(p->pages[j].data);
+    free(p->pages);
+    free(p->checkpoints);
+    free(p->line);
+    if (p->fd != -1) close(p->fd);
+    coldFree(&p->cold);
+    memset(p, 0, sizeof(*p));
+}
+
+/*
+ * Bytes of the file from off up to the end of its page,
+ * reading the page in (and evicting its slot) when needed
+ */
+char* pagerGet(off_t off, size_t* avail) {
+    struct pager* p = &E.pager;
+    off_t base = off - off % PAGER_PAGE;
+    struct pagerpage* pg = &p->pages[(base / PAGER_PAGE) % p->npages];
+
+    // Pages cost a decompression to refill there, so keep the LRU ones
+    if (p->cold.blocks) {
+        int j;
+        for (j = 0; j < p->npages && p->pages[j].off != base; j++)
+            if (p->pages[j].used < pg->used) pg = &p->pages[j];
+        if (j < p->npages) pg = &p->pages[j];
+    }
+    pg->used = ++p->tick;
+
+    if (pg->off != base && p->cold.blocks) {
+        if (pg->data == NULL && (pg->data = malloc(PAGER_PAGE)) == NULL)
+            die("malloc");
+        size_t len = p->size - base < PAGER_PAGE ? p->size - base : PAGER_PAGE;
+        pg->len = coldLoad(&p->cold, base / PAGER_PAGE, pg->data, len);
+        pg->off = base;
+    } else if (pg->off != base) {
+        if (pg->data == NULL && (pg->data = malloc(PAGER_PAGE)) == NULL)
+            die("malloc");
+        pg->len = 0;
+        while (pg->len < PAGER_PAGE && base + pg->len < p->size) {
+            ssize_t n = pread(p->fd, pg->data + pg->len,
+                    PAGER_PAGE - pg->len, base + pg->len);
+            if (n == -1 && errno == EINTR) continue;
+            if (n <= 0) die("pread");
+            pg->len += n;
+        }
+        pg->off = base;
+    }
+
+    *avail = pg->len - (off - base);
+    return pg->data + (off - base);
+}
+
+/*
+ * Count lines up to row n (or the end of the file), dropping a
+ * checkpoint every PAGER_CHECKPOINT lines on the way
+ */
+void pagerEnsureRows(ssize_t n) {
+    struct pager* p = &E.pager;
+
+    while (!E.indexdone && p->lines < n) {
+        if (p->scanned == p->size) {
+            if (p->size > 0 && p->lastbyte != '\n') p->lines++;
+            E.indexdone = 1;
+            break;
+        }
+
+        size_t avail;
+        char* data = pagerGet(p->scanned, &avail);
+        char* s = data;
+        char* end = data + avail;
+        char* nl;
+        while (s < end && (nl = memchr(s, '\n', end - s)) != NULL) {
+            s = nl + 1;
+            if (++p->lines % PAGER_CHECKPOINT != 0) continue;
+
+            if (p->ncheckpoints == p->checkcap) {
+                p->checkcap *= 2;
+                p->checkpoints = realloc(p->checkpoints, sizeof(off_t) * p->checkcap);
+                if (p->checkpoints == NULL) die("realloc");
+            }
+            p->checkpoints[p->ncheckpoints++] = p->scanned + (s - data);
+        }
+        p->lastbyte = end[-1];
+        p->scanned += avail;
+    }
+    E.numrows = p->lines;
+}
+
+// Offset just past the '\n' ending the line that starts at pos
+off_t pagerSkipLine(off_t pos) {
+    while (pos < E.pager.size) {
+        size_t avail;
+        char* data = pagerGet(pos, &avail);
+        char* nl = memchr(data, '\n', avail);
+        if (nl) return pos + (nl - data) + 1;
+        pos += avail;
+    }
+    return pos;
+}
+
+/*
+ * Row `at` as an erow, valid until the next call
+ * Start from the nearest checkpoint (or the row we read last, when
+ * that is closer) and step over at most PAGER_CHECKPOINT lines.
+ * Rows longer than PAGER_MAXLINE are cut off
+ */
+erow* pagerRow(ssize_t at) {
+    struct pager* p = &E.pager;
+    ssize_t row = at / PAGER_CHECKPOINT * PAGER_CHECKPOINT;
+    off_t pos = p->checkpoints[at / PAGER_CHECKPOINT];
+
+    if (p->currow <= at && p->currow > row) {
+        row = p->currow;
+        pos = p->curpos;
+    }
+    while (row < at) {
+        pos = pagerSkipLine(pos);
+        row++;
+    }
+
+    size_t len = 0, full = 0;
+    int ended = 0;
+    while (pos < p->size) {
+        size_t avail;
+        char* data = pagerGet(pos, &avail);
+        char* nl = memchr(data, '\n', avail);
+        size_t n = nl ? (size_t)(nl - data) : avail;
+        size_t keep = n < PAGER_MAXLINE - len ? n : PAGER_MAXLINE - len;
+
+        memcpy(p->line + len, data, keep);
+        len += keep;
+        full += n;
+        pos += n;
+        if (nl) {
+            pos++;
+            ended = 1;
+            break;
+        }
+    }
+    if (ended && len == full && len > 0 && p->line[len-1] == '\r') len--;
+
+    p->currow = at + 1;
+    p->curpos = pos;
+    erowSetView(&p->row, p->line, len);
+    return &p->row;
+}
+
+
+/*** soa rows ***/
+
+void soaLoad() {
+    struct rowsoa* soa = &E.soa;
+    size_t j, n, lf = 0, crlf = 0;
+
+    if (!E.indexdone)
+        lineIndexBuildParallel(&E.index, E.filemap, E.filemapsize,
+                lineIndexScanner(), E.indexthreads);
+    n = lineIndexCount(&E.index);
+
+    soa->sizes = malloc(sizeof(ssize_t) * (n + 1));
+    soa->flags = malloc(n + 1);
+    if (soa->sizes == NULL || soa->flags == NULL) die("malloc");
+    for (j = 0; j < n; j++) {
+        const char* line;
+        int eol;
+        size_t linelen = lineIndexLine(&E.index, E.filemap, E.filemapsize,
+                j, &line, &eol);
+        soa->sizes[j] = linelen;
+        soa->flags[j] = eol == EOL_CRLF ? ROWF_CRLF : 0;
+        soa->flags[j] |= utf8Classify(line, linelen) << ROWF_ENC_SHIFT;
+        crlf += eol == EOL_CRLF;
+        lf += eol == EOL_LF;
+    }
+    E.numrows = n;
+    editorSetEolStyle(lf, crlf);
+}
+
+void soaFree() {
+    free(E.soa.sizes);
+    free(E.soa.flags);
+    E.soa.sizes = NULL;
+    E.soa.flags = NULL;
+}
+
+erow* soaRow(ssize_t at) {
+    erowSetView(&E.soa.row, E.filemap + E.index.offs[at], E.soa.sizes[at]);
+    E.soa.row.enc = (E.soa.flags[at] & ROWF_ENC_MASK) >> ROWF_ENC_SHIFT;
+    return &E.soa.row;
+}
+
+
+/*** row operations  ***/
+
+// Make sure the row array has room for n rows in total
+void editorRowReserve(ssize_t n) {
+    if (n <= E.rowcap) return;
+
+    ssize_t cap = E.rowcap ? E.rowcap : 64;
+    while (cap < n) cap *= 2;
+    erow* row = realloc(E.row, sizeof(erow) * cap);
+    if (row == NULL) die("realloc");
+    E.row = row;
+    E.rowcap = cap;
+}
+
+/*
+ * Insert a row holding a copy of s at `at`
+ * New rows come from the user, not the file, so they get copied
+ */
+void editorInsertRow(ssize_t at, const char* s, size_t len) {
+    if (at < 0 || at > E.numrows) return;
+    editorRowReserve(E.numrows + 1);
+
+    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
+    erowSetCopy(&E.row[at], &E.rowarena, s, len);
+    E.row[at].eol = E.neweol;
+    // Rows after the old last one need it ended, like the piece table
+    if (at == E.numrows && at > 0 && E.row[at - 1].eol == EOL_NONE)
+        E.row[at - 1].eol = E.neweol;
+    E.numrows++;
+}
+
+void editorAppendRow(char* s, size_t len) {
+    editorInsertRow(E.numrows, s, len);
+}
+
+/*
+ * Append a row which points straight into the file image
+ * No bytes are copied, so the row is NOT NUL terminated
+ */
+void editorAppendMappedRow(char* s, size_t len) {
+    editorRowReserve(E.numrows + 1);
+
+    erowSetView(&E.row[E.numrows], s, len);
+    E.row[E.numrows].eol = EOL_LF;
+    E.numrows++;
+}
+
+/*
+ * Copy on write: rows viewing the file image (or sitting in the
+ * arena, which can't grow) get their own heap copy the first time
+ * they are written, with room for `extra` more bytes. Rows that
+ * are never edited never get copied
+ */
+char* erowMakeWritable(erow* row, ssize_t extra) {
+    ssize_t need = row->size + extra;
+    char* chars;
+
+    row->enc = ENC_UNKNOWN;
+    if (row->storage == ROW_INLINE && need <= ROW_INLINE_MAX)
+        return row->u.inl;
+
+    if (row->storage == ROW_HEAP) {
+        chars = realloc(row->u.chars, need + 1);
+        if (chars == NULL) die("realloc");
+    } else {
+        chars = malloc(need + 1);
+        if (chars == NULL) die("malloc");
+        memcpy(chars, erowChars(row), row->size);
+        chars[row->size] = '\0';
+        row->storage = ROW_HEAP;
+    }
+    row->u.chars = chars;
+    return chars;
+}
+
+void editorFreeRow(erow* row) {
+    if (row->storage == ROW_HEAP) free(row->u.chars);
+}
+
+void editorDelRow(ssize_t at) {
+    if (at < 0 || at >= E.numrows) return;
+    editorFreeRow(&E.row[at]);
+    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
+    E.numrows--;
+}
+
+void editorRowInsertChar(erow* row, ssize_t at, int c) {
+    if (at < 0 || at > row->size) at = row->size;
+    char* chars = erowMakeWritable(row, 1);
+    memmove(&chars[at + 1], &chars[at], row->size - at + 1);
+    chars[at] = c;
+    row->size++;
+}
+
+void editorRowAppendString(erow* row, const char* s, size_t len) {
+    char* chars = erowMakeWritable(row, len);
+    memcpy(&chars[row->size], s, len);
+    row->size += len;
+    chars[row->size] = '\0';
+}
+
+void editorRowDelChar(erow* row, ssize_t at) {
+    if (at < 0 || at >= row->size) return;
+    char* chars = erowMakeWritable(row, 0);
+    memmove(&chars[at], &chars[at + 1], row->size - at);
+    row->size--;
+}
+
+// Cut the row short at `at`, what follows has been copied elsewhere
+void editorRowTruncate(erow* row, ssize_t at) {
+    char* chars = erowMakeWritable(row, 0);
+    row->size = at;
+    chars[at] = '\0';
+}
+
+// Let go of the file image, whichever way it was read in
+void editorReleaseImage() {
+    if (E.filemap && E.filemapheap) free(E.filemap);
+    else if (E.filemap) munmap(E.filemap, E.filemapsize);
+    E.filemap = NULL;
+    E.filemapsize = 0;
+    E.filemapheap = 0;
+}
+
+/*
+ * Throw away the whole buffer, only rows that were modified
+ * have to be freed one at a time
+ */
+void editorFreeRows() {
+    ssize_t j;
+
+    loaderStop();
+    gzClose();
+    pagerClose();
+    soaFree();
+    for (j = 0; E.backend == BACKEND_ARRAY && j < E.numrows; j++)
+        if (E.row[j].storage == ROW_HEAP) free(E.row[j].u.chars);
+    arenaRelease(&E.rowarena);
+
+    free(E.row);
+    E.row = NULL;
+    E.numrows = E.rowcap = 0;
+    E.winstart = E.winlen = 0;
+    E.indexed = 0;
+    E.indexdone = 0;
+
+    ptFree();
+    ropeFree();
+
+    editorReleaseImage();
+    E.dirty = 0;
+    E.indexstale = 0;
+    E.eolstyle = EOLS_LF;
+    E.neweol = EOL_LF;
+    lineIndexFree(&E.index);
+}
+
+
+/*** lazy rows ***/
+
+/*
+ * Only the rows in [winstart, winstart + winlen) exist as erows,
+ * everything else is just an offset in the line index. Moving the
+ * window decodes the rows around `at` again, which is a handful of
+ * pointer computations per row
+ */
+void lazyMoveWindow(ssize_t at) {
+    ssize_t start = at - E.lazymargin;
+    if (start < 0) start = 0;
+    ssize_t len = E.screenrows + 2 * E.lazymargin;
+    if (start + len > E.numrows) len = E.numrows - start;
+
+    editorRowReserve(len);
+    ssize_t j;
+    for (j = 0; j < len; j++) {
+        const char* line;
+        size_t linelen = lineIndexLine(&E.index, E.filemap, E.filemapsize,
+                start + j, &line, NULL);
+        erowSetView(&E.row[j], (char*)line, linelen);
+    }
+    E.winstart = start;
+    E.winlen = len;
+}
+
+erow* lazyRow(ssize_t at) {
+    if (at < E.winstart || at >= E.winstart + E.winlen) lazyMoveWindow(at);
+    return &E.row[at - E.winstart];
+}
+
+/*
+ * Make sure the first n rows are indexed (or the file is done)
+ * The lazy backend only indexes a chunk at a time, as far as the
+ * user has scrolled, so the first screen shows up right away
+ */
+void editorEnsureRows(ssize_t n) {
+    if (E.backend == BACKEND_PAGER) {
+        pagerEnsureRows(n);
+        return;
+    }
+    if (E.backend != BACKEND_LAZY) return;
+    if (E.loader.running) {
+        loaderPoll();
+        return;
+    }
+
+    while (!E.indexdone && E.numrows < n) {
+        E.indexdone = lineIndexExtend(&E.index, E.filemap, E.filemapsize,
+                &E.indexed, LAZY_INDEX_CHUNK, lineIndexScanner());
+        E.numrows = lineIndexCount(&E.index);
+    }
+}
+
+
+/*** row backend ***/
+
+// Binary search the line index for the row holding byte off
+ssize_t indexRowForOffset(size_t off, ssize_t* col) {
+    size_t lo = 0, hi = E.numrows;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (E.index.offs[mid] <= off) lo = mid;
+        else hi = mid;
+    }
+    *col = off - E.index.offs[lo];
+    return lo;
+}
+
+// Closest checkpoint before off, then step over the lines after it
+ssize_t pagerRowForOffset(off_t off, ssize_t* col) {
+    struct pager* p = &E.pager;
+
+    while (!E.indexdone && p->scanned <= off)
+        editorEnsureRows(E.numrows + 1);
+
+    size_t lo = 0, hi = p->ncheckpoints;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (p->checkpoints[mid] <= off) lo = mid;
+        else hi = mid;
+    }
+
+    ssize_t row = lo * PAGER_CHECKPOINT;
+    off_t pos = p->checkpoints[lo];
+    while (row + 1 < E.numrows) {
+        off_t next = pagerSkipLine(pos);
+        if (next > off) break;
+        pos = next;
+        row++;
+    }
+    *col = off - pos;
+    return row;
+}
+
+// The tree of the piece table or the rope, whichever holds the text
+struct tree* editorTextTree() {
+    return E.backend == BACKEND_PIECE ? &E.pt.tree : &E.rope.tree;
+}
+
+/*
+ * Row holding byte `off` of the text and that byte's column,
+ * -1 when there is no way to tell (array rows edited since the
+ * line index was built)
+ */
+ssize_t editorRowForOffset(size_t off, ssize_t* col) {
+    switch (E.backend) {
+        case BACKEND_PIECE:
+        case BACKEND_ROPE: {
+            struct tree* t = editorTextTree();
+            if (off > t->root->bytes) off = t->root->bytes;
+            return treeRowForOffset(t, off, col);
+        }
+        case BACKEND_PAGER:
+            if ((off_t)off >= E.pager.size) off = E.pager.size ? E.pager.size - 1 : 0;
+            return pagerRowForOffset(off, col);
+        case BACKEND_LAZY:
+            while (!E.indexdone && !E.loader.running && E.indexed <= off)
+                editorEnsureRows(E.numrows + 1);
+            /* fall through */
+        default:
+            if (E.index.offs == NULL || E.numrows == 0 || E.indexstale) return -1;
+            return indexRowForOffset(off, col);
+    }
+}
+
+/*
+ * Row `at` of whichever backend holds the text
+ * Only the array backend hands out pointers that stay valid,
+ * the others reuse one erow per call
+ */
+erow* editorRowAt(ssize_t at) {
+    switch (E.backend) {
+        case BACKEND_PIECE: return treeRow(&E.pt.tree, at);
+        case BACKEND_ROPE: return treeRow(&E.rope.tree, at);
+        case BACKEND_LAZY: return lazyRow(at);
+        case BACKEND_PAGER: return pagerRow(at);
+        case BACKEND_SOA: return soaRow(at);
+        default: return &E.row[at];
+    }
+}
+
+
+/*** bulk row passes ***/
+
+struct rowstats {
+    long long bytes; // Text bytes, line endings not counted
+    ssize_t maxlen;
+    ssize_t longrows; // Rows longer than the limit asked for
+    ssize_t crlfrows; // Rows that ended with "\r\n" (soa only)
+};
+
+/*
+ * One pass over every row for length statistics
+ * The soa backend only touches its sizes and flags arrays
+ */
+void editorRowStats(struct rowstats* st, ssize_t limit) {
+    ssize_t j;
+
+    memset(st, 0, sizeof(*st));
+    if (E.backend == BACKEND_SOA) {
+        const ssize_t* sizes = E.soa.sizes;
+        const unsigned char* flags = E.soa.flags;
+        for (j = 0; j < E.numrows; j++) {
+            ssize_t size = sizes[j];
+            st->bytes += size;
+            if (size > st->maxlen) st->maxlen = size;
+            st->longrows += size > limit;
+            st->crlfrows += flags[j] & ROWF_CRLF;
+        }
+        return;
+    }
+
+    for (j = 0; j < E.numrows; j++) {
+        ssize_t size = E.backend == BACKEND_ARRAY ? E.row[j].size : editorRowAt(j)->size;
+        st->bytes += size;
+        if (size > st->maxlen) st->maxlen = size;
+        st->longrows += size > limit;
+    }
+}
+
+
+/*** line interning ***/
+
+// Hash a word at a time, a line costs about what copying it does
+unsigned long long internHash(const char* s, size_t len) {
+    unsigned long long h = len * 0x9e3779b97f4a7c15ull, w;
+
+    for (; len >= 8; s += 8, len -= 8) {
+        memcpy(&w, s, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdull;
+        h ^= h >> 32;
+    }
+    w = 0;
+    memcpy(&w, s, len);
+    h = (h ^ w) * 0xc4ceb9fe1a85ec53ull;
+    return h ^ (h >> 29);
+}
+
+void internInit(struct interntab* t, size_t lines) {
+    t->cap = 1024;
+    while (t->cap < lines * 2 && t->cap < ((size_t)1 << 30)) t->cap *= 2;
+    t->used = 0;
+    t->slots = calloc(t->cap, sizeof(struct internslot));
+    if (t->slots == NULL) die("calloc");
+}
+
+void internFree(struct interntab* t) {
+    free(t->slots);
+    memset(t, 0, sizeof(*t));
+}
+
+struct internslot* internFind(struct interntab* t, const char* s, ssize_t len,
+        unsigned long long h) {
+    size_t j = h & (t->cap - 1);
+    while (t->slots[j].chars &&
+            (t->slots[j].hash != h || t->slots[j].size != len ||
+             memcmp(t->slots[j].chars, s, len) != 0))
+        j = (j + 1) & (t->cap - 1);
+    return &t->slots[j];
+}
+
+void internGrow(struct interntab* t) {
+    struct interntab bigger;
+    size_t j;
+
+    bigger.cap = t->cap * 2;
+    bigger.used = t->used;
+    bigger.slots = calloc(bigger.cap, sizeof(struct internslot));
+    if (bigger.slots == NULL) die("calloc");
+    for (j = 0; j < t->cap; j++) {
+        struct internslot* sl = &t->slots[j];
+        size_t k = sl->hash & (bigger.cap - 1);
+        if (sl->chars == NULL) continue;
+        while (bigger.slots[k].chars) k = (k + 1) & (bigger.cap - 1);
+        bigger.slots[k] = *sl;
+    }
+    free(t->slots);
+    *t = bigger;
+}
+
+/*
+ * Append a row holding s, sharing the arena copy of an identical
+ * row loaded before it. Short rows are inline anyway. Shared rows
+ * are read-only like every arena row, and get their own copy the
+ * first time they're edited
+ */
+void internAppendRow(struct interntab* t, const char* s, ssize_t len) {
+    editorRowReserve(E.numrows + 1);
+    erow* row = &E.row[E.numrows++];
+
+    if (len <= ROW_INLINE_MAX) {
+        erowSetCopy(row, &E.rowarena, s, len);
+        row->enc = utf8Classify(s, len);
+        return;
+    }
+
+    unsigned long long h = internHash(s, len);
+    struct internslot* sl = internFind(t, s, len, h);
+    if (sl->chars) {
+        erowSetView(row, (char*)sl->chars, len);
+        row->storage = ROW_ARENA;
+        row->enc = sl->enc;
+        E.internsaved += len + 1;
+        return;
+    }
+
+    erowSetCopy(row, &E.rowarena, s, len);
+    row->enc = utf8Classify(s, len);
+    sl->chars = row->u.chars;
+    sl->size = len;
+    sl->enc = row->enc;
+    sl->hash = h;
+    if (++t->used * 2 > t->cap) internGrow(t);
+}
+
+
+/*** file i/o  ***/
+
+/*
+ * Slurp whatever fd gives us into one heap buffer
+ */
+char* editorReadAll(int fd, size_t* len) {
+    size_t cap = 64 * 1024;
+    char* buf = malloc(cap);
+    ssize_t n;
+
+    if (buf == NULL) die("malloc");
+    *len = 0;
+    while ((n = read(fd, buf + *len, cap - *len)) != 0) {
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            die("read");
+        }
+        *len += n;
+        if (*len == cap) {
+            cap *= 2;
+            buf = realloc(buf, cap);
+            if (buf == NULL) die("realloc");
+        }
+    }
+    return buf;
+}
+
+/*
+ * Chunked reads: the file is read READ_CHUNK bytes at a time with
+ * READ_DEPTH reads in flight, and whatever prefix of the file has
+ * fully arrived gets line indexed while the rest is still coming in.
+ * Reads go through io_uring when the kernel lets us have one, plain
+ * pread() otherwise (which still indexes chunk by chunk, it just
+ * can't overlap)
+ */
+struct chunkread {
+    int fd;
+    char* buf;
+    size_t size;
+    size_t nchunks;
+    unsigned char* done; // Chunks that have fully arrived
+    size_t ready;        // Chunks [0, ready) are all in
+    size_t scanned;      // Bytes handed to the line indexer
+    struct lineindex* li;
+};
+
+// Index everything up to the first chunk that is still missing
+void chunkReadAdvance(struct chunkread* cr) {
+    while (cr->ready < cr->nchunks && cr->done[cr->ready]) cr->ready++;
+    if (cr->li == NULL) return;
+
+    size_t upto = cr->ready * READ_CHUNK;
+    if (upto > cr->size) upto = cr->size;
+    if (upto > cr->scanned)
+        lineIndexExtend(cr->li, cr->buf, cr->size, &cr->scanned,
+                upto - cr->scanned, lineIndexScanner());
+}
+
+void chunkReadPread(struct chunkread* cr) {
+    size_t c;
+
+    for (c = 0; c < cr->nchunks; c++) {
+        size_t off = c * READ_CHUNK, got = 0;
+        size_t len = cr->size - off < READ_CHUNK ? cr->size - off : READ_CHUNK;
+        while (got < len) {
+            ssize_t n = pread(cr->fd, cr->buf + off + got, len - got, off + got);
+            if (n == -1 && errno == EINTR) continue;
+            if (n == -1) die("pread");
+            if (n == 0) {
+                errno = EIO; // File got shorter under us
+                die("pread");
+            }
+            got += n;
+        }
+        cr->done[c] = 1;
+        chunkReadAdvance(cr);
+    }
+}
+
+#ifdef KILO_URING
+// Just the parts of an io_uring we use, mapped by hand
+struct uring {
+    int fd;
+    unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+    unsigned *cqhead, *cqtail, *cqmask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void *sqring, *cqring;
+    size_t sqringsize, cqringsize, sqessize;
+};
+
+// A read in flight, re-queued from where it stopped on short reads
+struct uringslot {
+    size_t chunk;
+    size_t got;
+    size_t len;
+    struct iovec iov;
+};
+
+int uringSetup(struct uring* r, unsigned entries) {
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) return -1;
+
+    r->sqringsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cqringsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cqringsize > r->sqringsize) r->sqringsize = r->cqringsize;
+        r->cqringsize = r->sqringsize;
+    }
+    r->sqessize = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    r->sqring = mmap(NULL, r->sqringsize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    r->cqring = (p.features & IORING_FEAT_SINGLE_MMAP) ? r->sqring :
+        mmap(NULL, r->cqringsize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, r->sqessize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqring == MAP_FAILED || r->cqring == MAP_FAILED ||
+            r->sqes == MAP_FAILED) {
+        close(r->fd);
+        return -1;
+    }
+
+    char* sq = r->sqring;
+    char* cq = r->cqring;
+    r->sqhead = (unsigned*)(sq + p.sq_off.head);
+    r->sqtail = (unsigned*)(sq + p.sq_off.tail);
+    r->sqmask = (unsigned*)(sq + p.sq_off.ring_mask);
+    r->sqarray = (unsigned*)(sq + p.sq_off.array);
+    r->cqhead = (unsigned*)(cq + p.cq_off.head);
+    r->cqtail = (unsigned*)(cq + p.cq_off.tail);
+    r->cqmask = (unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+void uringFree(struct uring* r) {
+    munmap(r->sqes, r->sqessize);
+    if (r->cqring != r->sqring) munmap(r->cqring, r->cqringsize);
+    munmap(r->sqring, r->sqringsize);
+    close(r->fd);
+}
+
+// Queue the rest of a slot's chunk, the kernel sees it on the next enter
+void uringQueueRead(struct uring* r, struct chunkread* cr,
+        struct uringslot* slots, int s) {
+    struct uringslot* sl = &slots[s];
+    unsigned tail = *r->sqtail;
+    unsigned idx = tail & *r->sqmask;
+    struct io_uring_sqe* sqe = &r->sqes[idx];
+    size_t off = sl->chunk * READ_CHUNK + sl->got;
+
+    sl->iov.iov_base = cr->buf + off;
+    sl->iov.iov_len = sl->len - sl->got;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = cr->fd;
+    sqe->off = off;
+    sqe->addr = (unsigned long)&sl->iov;
+    sqe->len = 1;
+    sqe->user_data = s;
+    r->sqarray[idx] = idx;
+    __atomic_store_n(r->sqtail, tail + 1, __ATOMIC_RELEASE);
+}
+
+void chunkReadUring(struct chunkread* cr, struct uring* r) {
+    struct uringslot slots[READ_DEPTH];
+    int freeslots[READ_DEPTH], nfree = READ_DEPTH;
+    size_t next = 0;
+    int j, queued = 0;
+
+    for (j = 0; j < READ_DEPTH; j++) freeslots[j] = j;
+
+    while (cr->ready < cr->nchunks) {
+        while (nfree > 0 && next < cr->nchunks) {
+            int s = freeslots[--nfree];
+            slots[s].chunk = next;
+            slots[s].got = 0;
+            slots[s].len = cr->size - next * READ_CHUNK < READ_CHUNK ?
+                cr->size - next * READ_CHUNK : READ_CHUNK;
+            uringQueueRead(r, cr, slots, s);
+            queued++;
+            next++;
+        }
+
+        long submitted = syscall(__NR_io_uring_enter, r->fd, queued, 1,
+                IORING_ENTER_GETEVENTS, NULL, 0);
+        if (submitted == -1) {
+            if (errno == EINTR) continue;
+            die("io_uring_enter");
+        }
+        /*
+         * The kernel may take only some of the queue, and then it
+         * returns without waiting. The rest are still in the ring
+         * and go with the next call
+         */
+        queued -= submitted;
+
+        unsigned head = *r->cqhead;
+        unsigned tail = __atomic_load_n(r->cqtail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe* cqe = &r->cqes[head & *r->cqmask];
+            int s = cqe->user_data;
+            int res = cqe->res;
+
+            if (res == -EINTR || res == -EAGAIN) {
+                res = 0;
+            } else if (res < 0) {
+                errno = -res;
+                die("io_uring read");
+            } else if (res == 0) {
+                errno = EIO; // File got shorter under us
+                die("io_uring read");
+            }
+
+            slots[s].got += res;
+            if (slots[s].got < slots[s].len) {
+                uringQueueRead(r, cr, slots, s);
+                queued++;
+            } else {
+                cr->done[slots[s].chunk] = 1;
+                freeslots[nfree++] = s;
+            }
+        }
+        __atomic_store_n(r->cqhead, head, __ATOMIC_RELEASE);
+
+        chunkReadAdvance(cr);
+    }
+}
+#endif
+
+/*
+ * Read a regular file of `size` bytes into one heap buffer, building
+ * li (when given) as the chunks arrive
+ */
+char* editorReadChunked(int fd, size_t size, struct lineindex* li) {
+    struct chunkread cr;
+
+    cr.fd = fd;
+    cr.size = size;
+    cr.buf = malloc(size);
+    cr.nchunks = (size + READ_CHUNK - 1) / READ_CHUNK;
+    cr.done = calloc(cr.nchunks, 1);
+    cr.ready = cr.scanned = 0;
+    cr.li = li;
+    if (cr.buf == NULL || cr.done == NULL) die("malloc");
+
+#ifdef KILO_URING
+    struct uring r;
+    if (uringSetup(&r, READ_DEPTH) == 0) {
+        chunkReadUring(&cr, &r);
+        uringFree(&r);
+    } else {
+        chunkReadPread(&cr);
+    }
+#else
+    chunkReadPread(&cr);
+#endif
+
+    free(cr.done);
+    return cr.buf;
+}
+
+/*
+ * Split the file image into rows without copying anything
+ * A row ends at '\n', a '\r' right before it is part of the ending
+ * which the row remembers for saving
+ */
+void editorLoadMap() {
+    if (!E.indexdone)
+        lineIndexBuildParallel(&E.index, E.filemap, E.filemapsize,
+                lineIndexScanner(), E.indexthreads);
+
+    size_t i, n = lineIndexCount(&E.index), lf = 0, crlf = 0;
+    struct interntab tab;
+    editorRowReserve(E.numrows + n);
+    if (E.intern) internInit(&tab, n);
+    E.internsaved = 0;
+    for (i = 0; i < n; i++) {
+        const char* line;
+        int eol;
+        size_t linelen = lineIndexLine(&E.index, E.filemap, E.filemapsize,
+                i, &line, &eol);
+        if (E.intern) {
+            internAppendRow(&tab, line, linelen);
+        } else {
+            editorAppendMappedRow((char*)line, linelen);
+            E.row[E.numrows - 1].enc = utf8Classify(line, linelen);
+        }
+        E.row[E.numrows - 1].eol = eol;
+        crlf += eol == EOL_CRLF;
+        lf += eol == EOL_LF;
+    }
+    editorSetEolStyle(lf, crlf);
+
+    // Every row has a copy of its own now, the image can go
+    if (E.intern) {
+        internFree(&tab);
+        editorReleaseImage();
+    }
+}
+
+/*
+ * Allow the user to open an actual file to edit :-)
+ *
+ * The whole file becomes the file image: regular files are mmap'ed,
+ * anything we can't map (pipes, empty files) is read into the heap.
+ * Rows start out as views into the image and only get a copy of
+ * their own when they are edited, so startup cost and memory don't
+ * double for big files
+ */
+void editorOpen(char* filename) {
+    editorFreeRows();
+
+    free(E.filename);
+    E.filename = strdup(filename);
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) die("open");
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) die("fstat");
+
+    if (S_ISREG(st.st_mode) && gzIsCompressed(fd)) {
+        // The pager would page through the compressed bytes
+        if (E.backend == BACKEND_PAGER)
+            editorSetStatusMessage("Compressed file: %s ignored, inflating instead",
+                    E.coldstore ? "-z" : "-B pager");
+        // Compressed files are browsed read-only while they inflate
+        E.backend = BACKEND_LAZY;
+        E.coldstore = 0;
+        gzOpen(fd, st.st_size);
+        loaderStart();
+        return;
+    }
+
+    if (E.backend == BACKEND_PAGER && !E.coldstore) {
+        if (S_ISREG(st.st_mode)) {
+            pagerOpen(fd, st.st_size);
+            editorEnsureRows(E.screenrows);
+            return;
+        }
+        // Nothing to pread() from, hold it all in memory instead
+        E.backend = BACKEND_ARRAY;
+    }
+
+    char* map = MAP_FAILED;
+    if (S_ISREG(st.st_mode) && st.st_size > 0 && E.chunkedread) {
+        // Piece table and rope keep their own newline index
+        int index = E.backend != BACKEND_PIECE && E.backend != BACKEND_ROPE;
+        E.filemap = editorReadChunked(fd, st.st_size, index ? &E.index : NULL);
+        E.filemapsize = st.st_size;
+        E.filemapheap = 1;
+        if (index) {
+            E.indexed = E.filemapsize;
+            E.indexdone = 1;
+        }
+    } else if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    if (E.filemap) {
+        // Already read in
+    } else if (map != MAP_FAILED) {
+        E.filemap = map;
+        E.filemapsize = st.st_size;
+    } else {
+        E.filemap = editorReadAll(fd, &E.filemapsize);
+        E.filemapheap = 1;
+    }
+    close(fd);
+
+    if (E.backend == BACKEND_PAGER) {
+        // Only the compressed copy stays resident
+        pagerOpenCold(E.filemap, E.filemapsize);
+        editorReleaseImage();
+        E.indexed = 0;
+        E.indexdone = 0;
+        lineIndexFree(&E.index);
+        editorEnsureRows(E.screenrows);
+        return;
+    }
+
+    if (E.backend == BACKEND_PIECE || E.backend == BACKEND_ROPE)
+        editorDetectEols(E.filemap, E.filemapsize);
+    if (E.backend == BACKEND_PIECE)
+        ptLoad(E.filemap, E.filemapsize);
+    else if (E.backend == BACKEND_ROPE)
+        ropeLoad(E.filemap, E.filemapsize);
+    else if (E.backend == BACKEND_SOA)
+        soaLoad();
+    else if (E.backend == BACKEND_LAZY && E.async && !E.indexdone)
+        loaderStart();
+    else if (E.backend == BACKEND_LAZY && E.indexdone)
+        E.numrows = lineIndexCount(&E.index);
+    else if (E.backend == BACKEND_LAZY)
+        editorEnsureRows(E.screenrows + E.lazymargin);
+    else
+        editorLoadMap();
+}
+
+/*
+ * Write the text out exactly as it is held: array rows get back the
+ * ending each one was read with, the piece table and rope never lost
+ * theirs in the first place
+ */
+void editorWriteText(FILE* fp) {
+    ssize_t j;
+
+    if (E.backend == BACKEND_PIECE || E.backend == BACKEND_ROPE) {
+        struct tree* t = editorTextTree();
+        if (t->root) treeWriteNode(t, fp, t->root);
+    } else {
+        for (j = 0; j < E.numrows; j++) {
+            erow* row = &E.row[j];
+            fwrite(erowChars(row), 1, row->size, fp);
+            if (row->eol == EOL_CRLF) fwrite("\r\n", 1, 2, fp);
+            else if (row->eol == EOL_LF) fwrite("\n", 1, 1, fp);
+        }
+    }
+}
+
+/*
+ * Save through a temporary file that is renamed over the original
+ * Clean rows still view the old file, so it can't be written in place
+ */
+int editorWriteFile(const char* filename, size_t* written) {
+    size_t tmplen = strlen(filename) + 16;
+    char* tmp = malloc(tmplen);
+    struct stat st;
+
+    if (tmp == NULL) die("malloc");
+    snprintf(tmp, tmplen, "%s.kiloXXXXXX", filename);
+    int fd = mkstemp(tmp);
+    if (fd == -1) {
+        free(tmp);
+        return -1;
+    }
+    if (stat(filename, &st) == 0) fchmod(fd, st.st_mode & 07777);
+    else fchmod(fd, 0644);
+
+    FILE* fp = fdopen(fd, "w");
+    if (fp == NULL) {
+        close(fd);
+        unlink(tmp);
+        free(tmp);
+        return -1;
+    }
+    editorWriteText(fp);
+    *written = ftell(fp);
+
+    int err = ferror(fp);
+    if (fclose(fp) != 0) err = 1;
+    if (err || rename(tmp, filename) == -1) {
+        int saved = errno;
+        unlink(tmp);
+        free(tmp);
+        errno = saved;
+        return -1;
+    }
+    free(tmp);
+    return 0;
+}
+
+/*** append buffer ***/
+
+// Times an abuf had to grow, a frame drawn in steady state adds none
+unsigned long abAllocs = 0;
+
+// Make room for at least n bytes, doubling so appends stay cheap
+int abReserve(struct abuf *ab, size_t n) {
+    if (n <= ab->cap) return 0;
+    size_t cap = ab->cap ? ab->cap : 64;
+    while (cap < n) cap *= 2;
+
+    char *new = realloc(ab->b, cap);
+    if (new == NULL) return -1;
+    ab->b = new;
+    ab->cap = cap;
+    abAllocs++;
+    return 0;
+}
+
+void abAppend(struct abuf *ab, const char *s, size_t len) {
+    if (abReserve(ab, ab->len + len) == -1) return;
+
+    memcpy(&ab->b[ab->len], s, len);
+    ab->len += len;
+}
+
+void abFree(struct abuf *ab) {
+    free(ab->b);
+    ab->b = NULL;
+    ab->len = ab->cap = 0;
+}
+
+
+/*** output ***/
+
+
+/*
+ * How to get the row offset ? 
+ * We check if the cursor has gone out of the screen, and if it has
+ * then, adjust E.rowoff so that the cursor is still in the screen
+ */
+void editorScroll() {
+    E.rx = E.cy < E.numrows ? erowCxToRx(editorRowAt(E.cy), E.cx) : 0;
+
+    if (E.cy < E.rowoff) {
+        E.rowoff = E.cy;
+    }
+    if (E.cy >= E.rowoff + E.screenrows) {
+        E.rowoff = E.cy - E.screenrows + 1;
+    }
+    if (E.rx < E.coloff) {
+        E.coloff = E.rx;
+    }
+    if (E.rx >= E.coloff + E.screencols) {
+        E.coloff = E.rx - E.screencols + 1;
+    }
+}
+
+void editorComposeCell(struct cell* c, const char* s, size_t n, int attr) {
+    memcpy(c->ch, s, n);
+    c->len = n;
+    c->attr = attr;
+}
+
+/*
+ * Put the characters of s into screen cells. s starts at text column
+ * rx and screen column 0 shows text column `from`, what is left of it
+ * is cut off. Tabs become spaces up to the next tab stop and wide
+ * characters take two cells, a character only partly on the screen
+ * shows as blanks. Control bytes would move the terminal cursor
+ * around behind our back, they are shown as ^@ style letters in
+ * reverse video instead. Code points that can't be printed and
+ * bytes past ASCII on rows that aren't UTF-8 (which a UTF-8 terminal
+ * might put together into fewer columns) show as a reverse video ?.
+ * Returns the screen column after the last one filled
+ */
+int editorComposeChars(struct cell* line, const char* s, size_t len,
+        int utf8, int attr, ssize_t rx, ssize_t from) {
+    struct cell* last = NULL; // Where a combining mark goes
+    ssize_t col = rx - from;
+    size_t j = 0;
+
+    // Carry on one column past the edge for marks on the last character
+    while (j < len && col <= E.screencols) {
+        unsigned char b = s[j];
+        size_t n = 1;
+        if (utf8)
+            while (j + n < len && n < 4 && UTF8_CONT(s[j + n])) n++;
+        int w = editorCharWidth(s + j, n, col + from);
+
+        if (w == 0) {
+            if (last && last->len + n <= sizeof(last->ch)) {
+                memcpy(last->ch + last->len, s + j, n);
+                last->len += n;
+            }
+            j += n;
+            continue;
+        }
+
+        last = NULL;
+        if (w < 0) {
+            if (col >= 0 && col < E.screencols)
+                editorComposeCell(&line[col], "?", 1, attr ^ CELL_REVERSE);
+            w = 1;
+        } else if (b == '\t' || col < 0 || col + w > E.screencols) {
+            ssize_t k;
+            for (k = col; k < col + w && k < E.screencols; k++)
+                if (k >= 0) editorComposeCell(&line[k], " ", 1, attr);
+        } else if (b < 32 || b == 127 || (!utf8 && b > 127)) {
+            // Off UTF-8 rows a high byte could join its neighbours
+            char c = b >= 127 ? '?' : '@' + b;
+            editorComposeCell(&line[col], &c, 1, attr ^ CELL_REVERSE);
+        } else {
+            last = &line[col];
+            editorComposeCell(last, s + j, n, attr);
+            if (w == 2) editorComposeCell(&line[col + 1], "", 1, attr | CELL_TAIL);
+        }
+        col += w;
+        j += n;
+    }
+    // A row that ends left of the screen has nothing on it
+    if (col < 0) return 0;
+    return col < E.screencols ? col : E.screencols;
+}
+
+// Put the characters of s into screen cells from col on
+int editorComposeText(struct cell* line, int col, const char* s, size_t len,
+        int utf8, int attr) {
+    return editorComposeChars(line, s, len, utf8, attr, col, 0);
+}
+
+// Blank cells from col to the end of the line
+void editorComposeBlank(struct cell* line, int col, int attr) {
+    for (; col < E.screencols; col++) {
+        line[col].ch[0] = ' ';
+        line[col].len = 1;
+        line[col].attr = attr;
+    }
+}
+
+/*
+ * Compose screen line y, ~ on left hand side of the screen at the
+ * end of the file
+ */
+void editorComposeRow(struct cell* line, int y) {
+    ssize_t filerow = y + E.rowoff;
+    int col = 0;
+    /* 
+     * Check if there is something in text buffer
+     * If there is not then we draw the welcome page
+     * else we draw the text buffer
+     */
+    if (filerow >= E.numrows) {  
+        if (E.numrows == 0 && y == E.screenrows / 3) {
+            char welcome[80];
+            int welcomelen = snprintf(welcome, sizeof(welcome),
+                    "Aniket's Editor -- version %s", KILO_VERSION);
+            if (welcomelen > E.screencols) welcomelen = E.screencols;
+
+            /* Center the welcome message 
+             * Divide the screen's width in half and subtract
+             * half of the string's length. This gives us the
+             * how far from left edge would we start printing
+             */
+            int padding = (E.screencols - welcomelen) / 2;
+            if (padding) {
+                col = editorComposeText(line, col, "~", 1, 0, 0);
+                padding--;
+            }
+            while (padding--) col = editorComposeText(line, col, " ", 1, 0, 0);
+            col = editorComposeText(line, col, welcome, welcomelen, 0, 0);
+        } else {
+            col = editorComposeText(line, col, "~", 1, 0, 0);
+        } 
+    } else {
+        erow* row = editorRowAt(filerow);
+        // Start from the character under the left edge of the screen
+        ssize_t start = erowRxToCx(row, E.coloff);
+        col = editorComposeChars(line, erowChars(row) + start, row->size - start,
+                erowEncoding(row) == ENC_UTF8, 0, erowCxToRx(row, start), E.coloff);
+    }
+    editorComposeBlank(line, col, 0);
+}
+
+/*
+ * Inverted bar at the bottom: file name, line count and how far
+ * along indexing is while the file is still being loaded
+ */
+void editorDrawStatusBar(struct abuf *ab) {
+    char status[80], rstatus[80];
+    int len, rlen;
+
+    len = snprintf(status, sizeof(status), "%.20s - %zd%s lines%s",
+            E.filename ? E.filename : "[No Name]", E.numrows,
+            (E.backend >= BACKEND_LAZY && !E.indexdone) ? "+" : "",
+            E.dirty ? " (modified)" : "");
+    if (E.loader.running && E.gz.running) {
+        size_t in = __atomic_load_n(&E.gz.consumed, __ATOMIC_RELAXED);
+        len += snprintf(status + len, sizeof(status) - len, " (inflating %d%%)",
+                E.gz.insize ? (int)(in * 100 / E.gz.insize) : 100);
+    } else if (E.loader.running) {
+        len += snprintf(status + len, sizeof(status) - len, " (loading %d%%)",
+                E.filemapsize ? (int)(E.indexed * 100 / E.filemapsize) : 100);
+    }
+    if (E.gz.running && __atomic_load_n(&E.gz.error, __ATOMIC_RELAXED))
+        len += snprintf(status + len, sizeof(status) - len, " (gzip: damaged)");
+    if (E.intern && E.internsaved)
+        len += snprintf(status + len, sizeof(status) - len, " (%zuKB shared)",
+                E.internsaved / 1024);
+    if (E.pager.cold.blocks && E.pager.size)
+        len += snprintf(status + len, sizeof(status) - len, " (cold %d%%)",
+                (int)(E.pager.cold.bytes * 100 / E.pager.size));
+    if (len > (int)sizeof(status) - 1) len = sizeof(status) - 1;
+    static const char* eolnames[] = {"LF", "CRLF", "mixed"};
+    rlen = snprintf(rstatus, sizeof(rstatus), "%s%s%zd/%zd",
+            E.backend < BACKEND_LAZY ? eolnames[E.eolstyle] : "",
+            E.backend < BACKEND_LAZY ? " | " : "", E.cy + 1, E.numrows);
+
+    if (len > E.screencols) len = E.screencols;
+    abAppend(ab, status, len);
+    while (len < E.screencols) {
+        if (E.screencols - len == rlen) {
+            abAppend(ab, rstatus, rlen);
+            break;
+        }
+        abAppend(ab, " ", 1);
+        len++;
+    }
+}
+
+/*
+ * One line under the status bar for messages and prompts,
+ * a message goes away after 5 seconds
+ */
+void editorDrawMessageBar(struct abuf *ab) {
+    int msglen = strlen(E.statusmsg);
+    if (msglen > E.screencols) msglen = E.screencols;
+    if (msglen && time(NULL) - E.statusmsg_time < 5)
+        abAppend(ab, E.statusmsg, msglen);
+}
+
+void editorSetStatusMessage(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
+    va_end(ap);
+    E.statusmsg_time = time(NULL);
+}
+
+/*
+ * Rows [from, to) changed, the screen lines that showed them on the
+ * last refresh get composed again on the next. Rows that weren't on
+ * the screen don't matter, scrolling to them draws them anyway
+ */
+void editorDamageRows(ssize_t from, ssize_t to) {
+    struct screen* sc = &E.screen;
+    ssize_t y, end;
+
+    if (sc->damage == NULL) return;
+    y = from - sc->rowoff > 0 ? from - sc->rowoff : 0;
+    end = to - sc->rowoff < sc->rows ? to - sc->rowoff : sc->rows;
+    for (; y < end; y++) sc->damage[y] = 1;
+}
+
+// Rows from `from` down shifted, like after splitting or joining rows
+void editorDamageBelow(ssize_t from) {
+    editorDamageRows(from, E.screen.rowoff + E.screen.rows);
+}
+
+/*
+ * Size the shadow frame for the terminal, nothing in it is known
+ * so the next refresh writes every cell
+ */
+void editorScreenResize() {
+    struct screen* sc = &E.screen;
+    size_t cells = (size_t)(E.screenrows + 2) * E.screencols;
+
+    sc->damage = realloc(sc->damage, E.screenrows + 1);
+    sc->cells = realloc(sc->cells, sizeof(struct cell) * (cells + 1));
+    sc->next = realloc(sc->next, sizeof(struct cell) * (cells + 1));
+    /*
+     * Room for a whole screen of 4-byte code points plus moves and
+     * attributes on every line, so redrawing everything doesn't have
+     * to grow the frame buffer either
+     */
+    if (sc->damage == NULL || sc->cells == NULL || sc->next == NULL ||
+            abReserve(&sc->frame, cells * 4 + (size_t)(E.screenrows + 2) * 32) == -1 ||
+            abReserve(&sc->bar, E.screencols + sizeof(E.statusmsg)) == -1)
+        die("realloc");
+    memset(sc->cells, 0, sizeof(struct cell) * cells);
+    sc->rows = E.screenrows;
+    sc->cols = E.screencols;
+    sc->cursory = sc->cursorx = -1;
+}
+
+/*
+ * The text lines of the shadow screen moved up by n lines (down when
+ * negative), like the terminal does when told to scroll: the lines
+ * scrolled in are blank and need drawing, damage moves with the rest
+ */
+void editorScreenShift(int n) {
+    struct screen* sc = &E.screen;
+    int rows = sc->rows, cols = sc->cols, k = n > 0 ? n : -n, y;
+    struct cell* cells = sc->cells;
+
+    if (n > 0) {
+        memmove(cells, cells + k * cols, sizeof(struct cell) * (rows - k) * cols);
+        memmove(sc->damage, sc->damage + k, rows - k);
+    } else {
+        memmove(cells + k * cols, cells, sizeof(struct cell) * (rows - k) * cols);
+        memmove(sc->damage + k, sc->damage, rows - k);
+    }
+    for (y = n > 0 ? rows - k : 0; y < (n > 0 ? rows : k); y++) {
+        editorComposeBlank(cells + y * cols, 0, 0);
+        sc->damage[y] = 1;
+    }
+}
+
+/*
+ * Work out what else has to be redrawn from how the view changed
+ * since the last refresh: everything when the terminal is new or the
+ * view moved sideways or a long way, the rows that came or went when
+ * the row count changed. A view that moved up or down by less than a
+ * screen is scrolled instead, returns by how many lines (0 if not)
+ */
+int editorDamageView() {
+    struct screen* sc = &E.screen;
+    ssize_t shift = E.rowoff - sc->rowoff;
+
+    if (sc->drawn && sc->rows == E.screenrows && sc->cols == E.screencols &&
+            sc->coloff == E.coloff && shift != 0 &&
+            shift > -sc->rows && shift < sc->rows &&
+            sc->numrows != 0 && E.numrows != 0) {
+        editorScreenShift(shift);
+        sc->rowoff = E.rowoff;
+    } else {
+        shift = 0;
+    }
+
+    if (!sc->drawn || sc->rows != E.screenrows || sc->cols != E.screencols ||
+            sc->rowoff != E.rowoff || sc->coloff != E.coloff ||
+            (sc->numrows != E.numrows && (sc->numrows == 0 || E.numrows == 0))) {
+        // The welcome message moves around with the size too
+        if (!sc->drawn || sc->rows != E.screenrows || sc->cols != E.screencols)
+            editorScreenResize();
+        memset(sc->damage, 1, sc->rows);
+    } else if (sc->numrows != E.numrows) {
+        ssize_t from = sc->numrows < E.numrows ? sc->numrows : E.numrows;
+        editorDamageBelow(from - 1);
+    }
+    sc->cols = E.screencols;
+    sc->rowoff = E.rowoff;
+    sc->coloff = E.coloff;
+    sc->numrows = E.numrows;
+    return shift;
+}
+
+/*
+ * Writing out the difference between two frames: where the terminal
+ * cursor is and with which attributes it writes. x is -1 when it's
+ * unknown and the screen width right after writing the last column,
+ * where all a terminal is sure to do is a carriage return
+ */
+struct paint {
+    struct abuf* ab;
+    int y, x;
+    int attr;
+};
+
+// Unchanged cells worth rewriting to save a cursor move around them
+#define PAINT_GAP 4
+
+int cellEqual(const struct cell* a, const struct cell* b) {
+    return a->len && a->len == b->len && a->attr == b->attr &&
+        memcmp(a->ch, b->ch, a->len) == 0;
+}
+
+int cellBlank(const struct cell* c) {
+    return c->len == 1 && c->ch[0] == ' ' && c->attr == 0;
+}
+
+// Move the cursor with whichever sequence is shortest
+void paintMove(struct paint* p, int y, int x) {
+    char cup[32], rel[32];
+    int n = 0, dy = y - p->y;
+
+    if (p->y == y && p->x == x) return;
+    if (y == 0 && x == 0) strcpy(cup, "\x1b[H");
+    else snprintf(cup, sizeof(cup), "\x1b[%d;%dH", y + 1, x + 1);
+
+    if (p->x >= 0) {
+        // A line feed may come with a carriage return, so only use
+        // it when heading for the first column anyway
+        if (x == 0 && dy > 0 && dy <= 3) {
+            rel[n++] = '\r';
+            while (dy--) rel[n++] = '\n';
+        } else if (p->x == E.screencols) {
+            n = sizeof(rel);
+        } else {
+            if (dy > 0) n += snprintf(rel + n, sizeof(rel) - n, "\x1b[%dB", dy);
+            else if (dy < 0) n += snprintf(rel + n, sizeof(rel) - n, "\x1b[%dA", -dy);
+            if (x == 0 && p->x != 0) rel[n++] = '\r';
+            else if (x > p->x) n += snprintf(rel + n, sizeof(rel) - n, "\x1b[%dC", x - p->x);
+            else if (x < p->x) n += snprintf(rel + n, sizeof(rel) - n, "\x1b[%dD", p->x - x);
+        }
+    }
+    if (p->x >= 0 && n < (int)strlen(cup)) abAppend(p->ab, rel, n);
+    else abAppend(p->ab, cup, strlen(cup));
+    p->y = y;
+    p->x = x;
+}
+
+/*
+ * Scroll the text lines up by n (down when negative) inside a scroll
+ * region that keeps the bars where they are. Setting and resetting
+ * the region both home the cursor
+ */
+void paintScroll(struct paint* p, int n) {
+    char buf[48];
+    int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r",
+            E.screenrows, n > 0 ? n : -n, n > 0 ? 'S' : 'T');
+    abAppend(p->ab, buf, len);
+    p->y = p->x = 0;
+}
+
+void paintAttr(struct paint* p, int attr) {
+    if (p->attr == attr) return;
+    if (attr & CELL_REVERSE) abAppend(p->ab, "\x1b[7m", 4);
+    else abAppend(p->ab, "\x1b[m", 3);
+    p->attr = attr;
+}
+
+/*
+ * Bring screen line y from `old` to `new`, writing only the spans
+ * that differ. Short runs of unchanged cells between two changes
+ * are written again rather than moved over, and a line that is
+ * blank from some column on is cleared from there with one EL
+ */
+void paintLine(struct paint* p, int y, struct cell* old, struct cell* new) {
+    int cols = E.screencols, x = 0, blank = cols, j, k;
+
+    while (blank > 0 && cellBlank(&new[blank - 1])) blank--;
+    while (x < cols) {
+        if (cellEqual(&old[x], &new[x])) {
+            x++;
+            continue;
+        }
+        if (x >= blank) {
+            paintMove(p, y, x);
+            paintAttr(p, 0);
+            abAppend(p->ab, "\x1b[K", 3);
+            break;
+        }
+
+        // A wide character is written whole, from its first cell
+        if (new[x].attr & CELL_TAIL) x--;
+        int end = x + 1, same = 0;
+        for (j = x + 1; j < blank && same <= PAINT_GAP; j++) {
+            if (cellEqual(&old[j], &new[j])) same++;
+            else same = 0, end = j + 1;
+        }
+        if (end < cols && (new[end].attr & CELL_TAIL)) end++;
+        paintMove(p, y, x);
+        for (k = x; k < end; k++) {
+            if (new[k].attr & CELL_TAIL) continue;
+            paintAttr(p, new[k].attr);
+            abAppend(p->ab, new[k].ch, new[k].len);
+        }
+        p->x = end;
+        x = end;
+    }
+}
+
+/*
+ * Compose the frame into the shadow screen and append what it
+ * takes to get the terminal there: only damaged text lines are
+ * composed again, the bars every time, and only cells that differ
+ * from what the terminal shows are written. Nothing at all is
+ * appended when nothing changed
+ */
+void editorRenderFrame(struct abuf* ab) {
+    struct screen* sc = &E.screen;
+    int cols = E.screencols, y;
+
+    int shift = editorDamageView();
+    struct paint p = {ab, sc->cursory, sc->cursorx, 0};
+    memcpy(sc->next, sc->cells, sizeof(struct cell) * (E.screenrows + 2) * cols);
+    for (y = 0; y < E.screenrows; y++) {
+        if (!sc->damage[y]) continue;
+        editorComposeRow(sc->next + y * cols, y);
+        sc->damage[y] = 0;
+    }
+
+    struct abuf* bar = &sc->bar;
+    struct cell* line = sc->next + E.screenrows * cols;
+    bar->len = 0;
+    editorDrawStatusBar(bar);
+    editorComposeBlank(line, editorComposeText(line, 0, bar->b, bar->len, 1,
+            CELL_REVERSE), CELL_REVERSE);
+    bar->len = 0;
+    line += cols;
+    editorDrawMessageBar(bar);
+    editorComposeBlank(line, editorComposeText(line, 0, bar->b, bar->len, 1, 0), 0);
+
+    /*
+     * It might happen that cursor might show up for a second when
+     * the terminal is drawing to the screen
+     * So we hide the cursor and display again when ready, unless the
+     * terminal can be told to show the whole frame at once
+     */
+    const char* begin = sc->sync ? "\x1b[?2026h" : "\x1b[?25l";
+    const char* end = sc->sync ? "\x1b[?2026l" : "\x1b[?25h";
+    abAppend(ab, begin, strlen(begin));
+    size_t hidden = ab->len;
+    if (shift) paintScroll(&p, shift);
+    for (y = 0; y < E.screenrows + 2; y++)
+        paintLine(&p, y, sc->cells + y * cols, sc->next + y * cols);
+    paintAttr(&p, 0);
+    int drew = ab->len != hidden;
+    if (!drew) ab->len -= strlen(begin); // Just moving, nothing to hide
+
+    // Mover cursor to the location pointed by co-ordinates
+    paintMove(&p, E.cy - E.rowoff, E.rx - E.coloff);
+
+    // Display the cursor (or the frame) again as we are ready
+    if (drew) abAppend(ab, end, strlen(end));
+    struct cell* cells = sc->cells;
+    sc->cells = sc->next;
+    sc->next = cells;
+    sc->cursory = p.y;
+    sc->cursorx = p.x;
+    sc->drawn = 1;
+}
+
+// Bring the terminal up to date with one write
+void editorRefreshScreen() {
+    struct screen* sc = &E.screen;
+    /*
+     * Make sure we are IN the screen
+     */
+    editorScroll();
+    editorEnsureRows(E.rowoff + E.screenrows);
+
+    struct abuf* ab = &sc->frame;
+    ab->len = 0;
+    editorRenderFrame(ab);
+
+    // Finally write the append buffer at once
+    if (ab->len) write(STDOUT_FILENO, ab->b, ab->len);
+}
+
+
+
+/*** editor operations ***/
+
+// Only the array, piece table and rope backends can be edited
+int editorCanEdit() {
+    if (E.backend == BACKEND_ARRAY || E.backend == BACKEND_PIECE ||
+            E.backend == BACKEND_ROPE)
+        return 1;
+    if (E.gz.running)
+        editorSetStatusMessage("Read-only: compressed file");
+    else
+        editorSetStatusMessage("Read-only: reopen with -B array, piece or rope to edit");
+    return 0;
+}
+
+// Byte offset of row `at`, column `col` in the piece table or rope
+size_t editorTextPos(ssize_t at, ssize_t col) {
+    return treeRowPos(editorTextTree(), at) + col;
+}
+
+void editorTextInsert(size_t pos, const char* s, size_t len) {
+    if (E.backend == BACKEND_PIECE) ptInsert(pos, s, len);
+    else ropeInsert(pos, s, len);
+}
+
+void editorTextDelete(size_t pos, size_t len) {
+    if (E.backend == BACKEND_PIECE) ptDelete(pos, len);
+    else ropeDelete(pos, len);
+}
+
+// Typing on the line past the end of the file starts a new row
+// Whether the text ends in a line ending
+int editorLastRowEnded() {
+    if (E.backend == BACKEND_ARRAY)
+        return E.numrows > 0 && E.row[E.numrows - 1].eol != EOL_NONE;
+    return E.numrows == (ssize_t)editorTextTree()->root->nls;
+}
+
+/*
+ * An empty last row without a line ending is the same text as no row
+ * at all, drop it so the array backend counts rows like the others
+ */
+void editorDropEmptyLastRow() {
+    if (E.backend == BACKEND_ARRAY && E.numrows > 0 &&
+            E.row[E.numrows - 1].size == 0 &&
+            E.row[E.numrows - 1].eol == EOL_NONE)
+        editorDelRow(E.numrows - 1);
+}
+
+/*
+ * The line past the end of the file is an empty last row without a
+ * line ending. The array backend has to make it a row of its own,
+ * in the text it is already there once the row before it is ended
+ */
+void editorOpenLastRow() {
+    if (E.cy != E.numrows) return;
+    if (E.backend == BACKEND_ARRAY) {
+        editorInsertRow(E.numrows, "", 0);
+        E.row[E.numrows - 1].eol = EOL_NONE;
+        return;
+    }
+
+    if (!editorLastRowEnded()) {
+        size_t nllen;
+        const char* nl = editorNewline(&nllen);
+        editorTextInsert(editorTextPos(E.numrows, 0), nl, nllen);
+    }
+}
+
+/*
+ * Edits work out byte positions from the cursor, so it has to be on
+ * the text and not past the end of its row
+ */
+void editorClampCursor() {
+    editorSetCursor(E.cy, E.cx);
+}
+
+void editorInsertChar(int c) {
+    if (!editorCanEdit()) return;
+    editorClampCursor();
+    editorOpenLastRow();
+    editorDamageRows(E.cy, E.cy + 1);
+
+    if (E.backend == BACKEND_ARRAY) {
+        editorRowInsertChar(&E.row[E.cy], E.cx, c);
+    } else {
+        char ch = c;
+        editorTextInsert(editorTextPos(E.cy, E.cx), &ch, 1);
+    }
+    E.cx++;
+    E.dirty++;
+    E.indexstale = 1;
+}
+
+void editorInsertNewline() {
+    if (!editorCanEdit()) return;
+    editorClampCursor();
+
+    size_t nllen;
+    const char* nl = editorNewline(&nllen);
+    editorDamageBelow(E.cy);
+
+    if (E.cy == E.numrows && E.backend == BACKEND_ARRAY) {
+        editorInsertRow(E.numrows, "", 0);
+    } else if (E.cy == E.numrows) {
+        editorOpenLastRow();
+        editorTextInsert(editorTextPos(E.cy, 0), nl, nllen);
+    } else if (E.backend == BACKEND_ARRAY) {
+        /*
+         * Grow E.row first: inline rows keep their bytes inside it,
+         * so the tail copied below must not move out from under us
+         */
+        editorRowReserve(E.numrows + 1);
+        erow* row = &E.row[E.cy];
+        int eol = row->eol;
+        editorInsertRow(E.cy + 1, erowChars(row) + E.cx, row->size - E.cx);
+        // The tail keeps the row's old ending
+        E.row[E.cy + 1].eol = eol;
+        E.row[E.cy].eol = E.neweol;
+        editorRowTruncate(&E.row[E.cy], E.cx);
+    } else {
+        editorTextInsert(editorTextPos(E.cy, E.cx), nl, nllen);
+    }
+    editorDropEmptyLastRow();
+    E.cy++;
+    E.cx = 0;
+    E.dirty++;
+    E.indexstale = 1;
+}
+
+/*
+ * Backspace: delete the character left of the cursor, at the start
+ * of a row join it onto the one above
+ */
+void editorDelChar() {
+    if (!editorCanEdit()) return;
+    editorClampCursor();
+    if (E.cx == 0 && E.cy == 0) return;
+    // Past the end there is only something to join if the text ends a row
+    if (E.cy == E.numrows && !editorLastRowEnded()) return;
+
+    // A whole code point goes at once on UTF-8 rows
+    ssize_t from = E.cx > 0 ? erowPrevChar(editorRowAt(E.cy), E.cx) : 0;
+    if (E.cx > 0) editorDamageRows(E.cy, E.cy + 1);
+    else editorDamageBelow(E.cy - 1);
+
+    if (E.backend == BACKEND_ARRAY && E.cy == E.numrows) {
+        // Only the line ending of the last row goes
+        E.cy--;
+        E.cx = E.row[E.cy].size;
+        E.row[E.cy].eol = EOL_NONE;
+    } else if (E.backend == BACKEND_ARRAY) {
+        erow* row = &E.row[E.cy];
+        if (E.cx > 0) {
+            while (E.cx > from) editorRowDelChar(row, --E.cx);
+        } else {
+            E.cx = E.row[E.cy - 1].size;
+            editorRowAppendString(&E.row[E.cy - 1], erowChars(row), row->size);
+            E.row[E.cy - 1].eol = row->eol;
+            editorDelRow(E.cy);
+            E.cy--;
+        }
+    } else if (E.cx > 0) {
+        editorTextDelete(editorTextPos(E.cy, from), E.cx - from);
+        E.cx = from;
+    } else {
+        // Drop the line ending of the row above, '\r' and all
+        ssize_t prevlen = editorRowAt(E.cy - 1)->size;
+        size_t start = editorTextPos(E.cy - 1, prevlen);
+        editorTextDelete(start, editorTextPos(E.cy, 0) - start);
+        E.cy--;
+        E.cx = prevlen;
+    }
+    editorDropEmptyLastRow();
+    E.dirty++;
+    E.indexstale = 1;
+}
+
+/*** input ***/
+
+/*
+ * Ask for a line of input on the message bar
+ * Returns NULL when the user gives up with ESC
+ */
+char* editorPrompt(char* prompt) {
+    size_t bufsize = 128;
+    char* buf = malloc(bufsize);
+    size_t buflen = 0;
+
+    if (buf == NULL) die("malloc");
+    buf[0] = '\0';
+
+    while (1) {
+        editorSetStatusMessage(prompt, buf);
+        editorRefreshScreen();
+
+        int c = editorReadKey();
+        if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
+            if (buflen != 0) buf[--buflen] = '\0';
+        } else if (c == '\x1b') {
+            editorSetStatusMessage("");
+            free(buf);
+            return NULL;
+        } else if (c == '\r') {
+            if (buflen != 0) {
+                editorSetStatusMessage("");
+                return buf;
+            }
+        } else if (c > 0 && c < 128 && !iscntrl(c)) {
+            if (buflen == bufsize - 1) {
+                bufsize *= 2;
+                buf = realloc(buf, bufsize);
+                if (buf == NULL) die("realloc");
+            }
+            buf[buflen++] = c;
+            buf[buflen] = '\0';
+        }
+    }
+}
+
+/*
+ * Put the cursor on row/col, clamped to the text
+ * Rows are only indexed as far as needed on the way
+ */
+void editorSetCursor(ssize_t row, ssize_t col) {
+    editorEnsureRows(row + 1);
+    if (row > E.numrows) row = E.numrows;
+    if (row < 0) row = 0;
+
+    erow* r = (row >= E.numrows) ? NULL : editorRowAt(row);
+    ssize_t rowlen = r ? r->size : 0;
+    if (col > rowlen) col = rowlen;
+    if (col < 0) col = 0;
+    if (r) col = erowCharStart(r, col);
+
+    E.cy = row;
+    E.cx = col;
+}
+
+/*
+ * Ctrl-G: jump to a line number, or to a byte offset with @
+ * Both are looked up in the line index (or checkpoints) instead of
+ * moving there a row at a time
+ */
+void editorGoto() {
+    char* query = editorPrompt("Go to line (@offset for a byte): %s");
+    if (query == NULL) return;
+
+    if (query[0] == '@') {
+        ssize_t col;
+        ssize_t row = editorRowForOffset(strtoull(query + 1, NULL, 10), &col);
+        if (row == -1)
+            editorSetStatusMessage("No byte offsets for this file");
+        else
+            editorSetCursor(row, col);
+    } else {
+        editorSetCursor(strtoll(query, NULL, 10) - 1, 0);
+    }
+    free(query);
+
+    // Show the target in the middle of the screen
+    E.rowoff = E.cy - E.screenrows / 2;
+    if (E.rowoff < 0) E.rowoff = 0;
+}
+
+void editorSave() {
+    if (!editorCanEdit()) return;
+
+    if (E.filename == NULL) {
+        E.filename = editorPrompt("Save as: %s (ESC to cancel)");
+        if (E.filename == NULL) {
+            editorSetStatusMessage("Save aborted");
+            return;
+        }
+    }
+
+    size_t written;
+    if (editorWriteFile(E.filename, &written) == -1) {
+        editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+        return;
+    }
+    E.dirty = 0;
+    editorSetStatusMessage("%zu bytes written to disk", written);
+}
+
+// Cursor Movement
+void editorMoveCursor(int key) {
+    // Know whether there is a row below before moving onto it
+    editorEnsureRows(E.cy + 2);
+
+    erow *row = (E.cy >= E.numrows) ? NULL : editorRowAt(E.cy);
+
+    switch(key) {
+        case ARROW_LEFT:
+            if (E.cx != 0) {
+                E.cx = erowPrevChar(row, E.cx);
+            } else if (E.cy > 0) {
+                /* Allow the user to move to the end of prev line
+                 * when "<-" arrow is pressed
+                 */
+                E.cy--;
+                E.cx = editorRowAt(E.cy)->size;
+            }
+            break;
+        case ARROW_RIGHT:
+            if (row && E.cx < row->size) {
+                E.cx = erowNextChar(row, E.cx);
+            } else if (row && E.cx == row->size) {
+                /* Allow the user to move to the start of the next line
+                 * when "->" arrow is pressed
+                 */
+                E.cy++;
+                E.cx = 0;
+            }
+            break;
+        case ARROW_UP:
+            if (E.cy != 0) {
+                E.cy--;
+            }
+            break;
+        case ARROW_DOWN:
+            if (E.cy < E.numrows) {
+                E.cy++;
+            }
+            break;
     }
     
     /*
@@ -473,19 +4379,29 @@ void editorMoveCursor(int key) {
      * moving the curosr past the last
      * character on the line
      */
-    row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
-    int rowlen = row ? row->size : 0;
+    row = (E.cy >= E.numrows) ? NULL : editorRowAt(E.cy);
+    ssize_t rowlen = row ? row->size : 0;
     if (E.cx > rowlen) {
         E.cx = rowlen;
     }
+    // Never leave the cursor inside a UTF-8 sequence
+    if (row) E.cx = erowCharStart(row, E.cx);
 }
 
 // Read the key pressed
 void editorProcessKeyPress() {
+    static int quit_times = KILO_QUIT_TIMES;
     int c = editorReadKey();
+    if (c == 0) return; // Timed out while loading, not a key
 
     switch(c) {
         case CTRL_KEY('q'):
+            if (E.dirty && quit_times > 0) {
+                editorSetStatusMessage("WARNING!!! File has unsaved changes. "
+                        "Press Ctrl-Q %d more times to quit.", quit_times);
+                quit_times--;
+                return;
+            }
             // Clear the screen and reposition the cursor on exit()
             write(STDOUT_FILENO, "\x1b[2J", 4);
             write(STDOUT_FILENO, "\x1b[H", 3);
@@ -497,18 +4413,22 @@ void editorProcessKeyPress() {
             break;
 
         case END_KEY:
-            E.cx = E.screencols - 1;
+            if (E.cy < E.numrows) E.cx = editorRowAt(E.cy)->size;
             break;
 
         case PAGE_UP:
         case PAGE_DOWN:
-            {
-                int times = E.screenrows;
-                while (times--) {
-                    editorMoveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
-                }
-                break;
-            }
+            editorSetCursor(E.cy + (c == PAGE_UP ? -E.screenrows : E.screenrows),
+                    E.cx);
+            break;
+
+        case CTRL_KEY('g'):
+            editorGoto();
+            break;
+
+        case CTRL_KEY('s'):
+            editorSave();
+            break;
 
         case ARROW_UP:
         case ARROW_DOWN:
@@ -516,7 +4436,436 @@ void editorProcessKeyPress() {
         case ARROW_RIGHT:
             editorMoveCursor(c);
             break;
+
+        case '\r':
+            editorInsertNewline();
+            break;
+
+        case BACKSPACE:
+        case CTRL_KEY('h'):
+        case DEL_KEY:
+            if (c == DEL_KEY) editorMoveCursor(ARROW_RIGHT);
+            editorDelChar();
+            break;
+
+        case CTRL_KEY('l'):
+        case '\x1b':
+            break;
+
+        default:
+            if (c == '\t' || (c > 0 && c < 128 && !iscntrl(c)))
+                editorInsertChar(c);
+            break;
+    }
+
+    quit_times = KILO_QUIT_TIMES;
+}
+
+/*** benchmark ***/
+
+double benchNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Run one scanner over the buffer on `threads` threads for at least
+ * half a second and print the throughput
+ */
+void benchLineIndex(const char* name, lineIndexScanFn scan, int threads,
+        const char* buf, size_t len) {
+    struct lineindex li = {NULL, 0, 0};
+    int runs = 0;
+    double start = benchNow(), elapsed;
+
+    do {
+        lineIndexBuildParallel(&li, buf, len, scan, threads);
+        runs++;
+    } while ((elapsed = benchNow() - start) < 0.5);
+
+    printf("  %-8s %10.1f MB/s  %zu lines\n", name,
+            (double)len * runs / elapsed / (1024 * 1024), lineIndexCount(&li));
+    lineIndexFree(&li);
+}
+
+/*
+ * Validate the buffer as UTF-8 for at least half a second, the ASCII
+ * fast path decides how quickly load-time row tagging goes
+ */
+void benchUtf8(const char* buf, size_t len) {
+    static const char* names[] = {"unknown", "ascii", "utf-8", "invalid"};
+    int runs = 0, enc = ENC_UNKNOWN;
+    double start = benchNow(), elapsed;
+
+    do {
+        enc = utf8Classify(buf, len);
+        runs++;
+    } while ((elapsed = benchNow() - start) < 0.5);
+
+    printf("utf-8 check:\n  %10.1f MB/s  %s\n",
+            (double)len * runs / elapsed / (1024 * 1024), names[enc]);
+}
+
+/*
+ * Build a cold store of the buffer and time block decompression,
+ * what the pager pays each time it refills a page under -z
+ */
+void benchColdStore(const char* buf, size_t len) {
+    struct coldstore cs;
+    char* page = malloc(PAGER_PAGE);
+    double start = benchNow(), built, elapsed;
+    size_t j = 0, bytes = 0;
+    if (page == NULL) die("malloc");
+
+    coldBuild(&cs, buf, len);
+    built = benchNow() - start;
+    start = benchNow();
+    do {
+        size_t n = len - j * PAGER_PAGE < PAGER_PAGE ? len - j * PAGER_PAGE : PAGER_PAGE;
+        bytes += coldLoad(&cs, j, page, n);
+        j = (j + 1) % cs.nblocks;
+    } while ((elapsed = benchNow() - start) < 0.5);
+
+    printf("cold store:\n  %10.1f MB/s  compress, %zu of %zu bytes (%.1f%%)\n"
+            "  %10.1f MB/s  decompress\n",
+            (double)len / built / (1024 * 1024), cs.bytes, len,
+            cs.bytes * 100.0 / len, (double)bytes / elapsed / (1024 * 1024));
+    coldFree(&cs);
+    free(page);
+}
+
+/*
+ * Render frames for an 80x24 terminal into memory and count the
+ * bytes each kind of update costs next to writing the whole screen
+ */
+void benchRenderSteps(const char* name, int steps, int key) {
+    struct abuf* ab = &E.screen.frame;
+    unsigned long allocs = abAllocs;
+    size_t bytes = 0;
+    int j;
+
+    for (j = 0; j < steps; j++) {
+        if (key == PAGE_DOWN) editorSetCursor(E.cy + E.screenrows, E.cx);
+        else if (key) editorMoveCursor(key);
+        else editorInsertChar('a' + j % 26);
+        editorScroll();
+        editorEnsureRows(E.rowoff + E.screenrows);
+        ab->len = 0;
+        editorRenderFrame(ab);
+        bytes += ab->len;
+    }
+    printf("  %-12s %8.1f bytes/frame %6.2f allocs/frame\n", name,
+            (double)bytes / steps, (double)(abAllocs - allocs) / steps);
+}
+
+void benchRender(char* buf, size_t len) {
+    struct abuf* ab = &E.screen.frame;
+    unsigned long allocs;
+
+    E.backend = BACKEND_ARRAY;
+    E.filemap = buf;
+    E.filemapsize = len;
+    editorLoadMap();
+    E.screenrows = 22;
+    E.screencols = 80;
+    E.cx = E.cy = E.rowoff = E.coloff = 0;
+    memset(&E.screen, 0, sizeof(E.screen));
+    editorScroll();
+    editorEnsureRows(E.screenrows);
+    allocs = abAllocs;
+    editorRenderFrame(ab);
+
+    printf("render (80x24):\n  %-12s %8zu bytes/frame %6lu allocs/frame\n",
+            "whole screen", ab->len, abAllocs - allocs);
+    benchRenderSteps("cursor right", 40, ARROW_RIGHT);
+    benchRenderSteps("line down", 100, ARROW_DOWN);
+    benchRenderSteps("typing", 40, 0);
+    benchRenderSteps("page down", 100, PAGE_DOWN);
+
+    abFree(&E.screen.frame);
+    abFree(&E.screen.bar);
+    free(E.screen.damage);
+    free(E.screen.cells);
+    free(E.screen.next);
+    memset(&E.screen, 0, sizeof(E.screen));
+    E.filemap = NULL; // Not ours to unmap
+    editorFreeRows();
+}
+
+/*
+ * Load the file into one backend, then time random row lookups,
+ * a screenful-at-a-time walk like drawing does and random edits
+ */
+void benchBackend(const char* name, int backend, char* buf, size_t len) {
+    int j, ops = 1000000;
+    long sum = 0;
+    double start, load, lookup, walk, edit = 0;
+
+    E.backend = backend;
+    E.filemap = buf;
+    E.filemapsize = len;
+
+    start = benchNow();
+    if (backend == BACKEND_PIECE) ptLoad(buf, len);
+    else if (backend == BACKEND_ROPE) ropeLoad(buf, len);
+    else if (backend == BACKEND_SOA) soaLoad();
+    else editorLoadMap();
+    load = benchNow() - start;
+
+    srand(1);
+    start = benchNow();
+    for (j = 0; j < ops; j++) sum += editorRowAt(rand() % E.numrows)->size;
+    lookup = (benchNow() - start) / ops;
+
+    start = benchNow();
+    for (j = 0; j < ops; j++) {
+        ssize_t at = (j / 50 * 7919 + j % 50) % E.numrows;
+        sum += editorRowAt(at)->size;
+    }
+    walk = (benchNow() - start) / ops;
+
+    // The ones typing goes into, through the same calls it makes
+    int editable = backend == BACKEND_ARRAY || backend == BACKEND_PIECE ||
+        backend == BACKEND_ROPE;
+    if (editable) {
+        int edits = 100000;
+        start = benchNow();
+        for (j = 0; j < edits; j++) {
+            ssize_t at = rand() % E.numrows;
+            if (backend == BACKEND_ARRAY) editorRowInsertChar(&E.row[at], 0, 'x');
+            else editorTextInsert(editorTextPos(at, 0), "x", 1);
+        }
+        edit = (benchNow() - start) / edits;
+    }
+
+    printf("  %-8s load %8.1f ms  lookup %7.1f ns  walk %7.1f ns  ",
+            name, load * 1e3, lookup * 1e9, walk * 1e9);
+    if (editable)
+        printf("insert %7.2f us\n", edit * 1e6);
+    else
+        printf("insert       -\n");
+    (void)sum;
+
+    E.filemap = NULL; // Not ours to unmap
+    editorFreeRows();
+}
+
+/*
+ * Copy every line into rows the way input that can't be mapped is
+ * loaded, and see how many fit inline
+ */
+void benchRowCopies(char* buf, size_t len) {
+    struct lineindex li = {NULL, 0, 0};
+    size_t j, n, inlined = 0, arena = 0;
+    struct arenachunk* c;
+
+    lineIndexBuild(&li, buf, len, lineIndexScanner());
+    n = lineIndexCount(&li);
+
+    double start = benchNow();
+    for (j = 0; j < n; j++) {
+        const char* line;
+        size_t linelen = lineIndexLine(&li, buf, len, j, &line, NULL);
+        editorAppendRow((char*)line, linelen);
     }
+    double elapsed = benchNow() - start;
+
+    for (j = 0; j < n; j++) inlined += E.row[j].storage == ROW_INLINE;
+    for (c = E.rowarena.head; c; c = c->next) arena += c->used;
+    printf("row copies:\n  %zu rows in %.1f ms, %.1f%% inline, "
+            "%zu KB rows + %zu KB arena\n", n, elapsed * 1e3,
+            n ? inlined * 100.0 / n : 0.0,
+            n * sizeof(erow) / 1024, arena / 1024);
+
+    lineIndexFree(&li);
+    editorFreeRows();
+}
+
+/*
+ * Time editorRowStats() over the whole file, the array backend
+ * walks erows while soa streams through its sizes array
+ */
+void benchRowScan(const char* name, int backend, char* buf, size_t len) {
+    struct rowstats st;
+    int runs = 0;
+    double start, elapsed;
+
+    E.backend = backend;
+    E.filemap = buf;
+    E.filemapsize = len;
+    if (backend == BACKEND_SOA) soaLoad();
+    else editorLoadMap();
+
+    start = benchNow();
+    do {
+        editorRowStats(&st, 80);
+        runs++;
+    } while ((elapsed = benchNow() - start) < 0.5);
+
+    printf("  %-8s %7.2f ns/row  longest %zd, %zd rows over 80\n", name,
+            elapsed / runs / E.numrows * 1e9, st.maxlen, st.longrows);
+
+    E.filemap = NULL; // Not ours to unmap
+    editorFreeRows();
+}
+
+/*
+ * kilo --bench <file>
+ * Measure the load time building blocks against a real file
+ */
+int editorBenchmark(char* filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) die("open");
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) die("fstat");
+    if (st.st_size == 0) {
+        fprintf(stderr, "%s: empty file\n", filename);
+        return 1;
+    }
+    char* buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (buf == MAP_FAILED) die("mmap");
+    close(fd);
+
+    // Fault the file in so the first scanner isn't measuring the disk
+    volatile char sink = 0;
+    off_t i;
+    for (i = 0; i < st.st_size; i += 4096) sink ^= buf[i];
+    (void)sink;
+
+    printf("line index (%lld bytes):\n", (long long)st.st_size);
+    benchLineIndex("scalar", lineIndexScanScalar, 1, buf, st.st_size);
+#ifdef KILO_SSE2
+    benchLineIndex("sse2", lineIndexScanSSE2, 1, buf, st.st_size);
+#endif
+#ifdef KILO_AVX2
+    if (lineIndexScanner() == lineIndexScanAVX2)
+        benchLineIndex("avx2", lineIndexScanAVX2, 1, buf, st.st_size);
+#endif
+    int threads;
+    for (threads = 2; threads <= E.indexthreads; threads *= 2) {
+        char name[16];
+        snprintf(name, sizeof(name), "%dthr", threads);
+        benchLineIndex(name, lineIndexScanner(), threads, buf, st.st_size);
+    }
+
+    benchUtf8(buf, st.st_size);
+    benchRowCopies(buf, st.st_size);
+    benchColdStore(buf, st.st_size);
+    benchRender(buf, st.st_size);
+
+    printf("backends:\n");
+    benchBackend("array", BACKEND_ARRAY, buf, st.st_size);
+    benchBackend("piece", BACKEND_PIECE, buf, st.st_size);
+    benchBackend("rope", BACKEND_ROPE, buf, st.st_size);
+    benchBackend("soa", BACKEND_SOA, buf, st.st_size);
+
+    printf("full row scans:\n");
+    benchRowScan("array", BACKEND_ARRAY, buf, st.st_size);
+    benchRowScan("soa", BACKEND_SOA, buf, st.st_size);
+
+    munmap(buf, st.st_size);
+    return 0;
+}
+
+/*** self-check ***/
+
+/*
+ * Rows of the synthetic file --selftest pages through: past 2^32,
+ * so a row number or checkpoint index kept in 32 bits anywhere wraps
+ */
+#define CHECK_ROWS (((ssize_t)1 << 32) + 3 * PAGER_CHECKPOINT + 10)
+#define CHECK_LINE 20   // "%019zd\n", every row as wide as the others
+#define CHECK_GAP 4096  // Bytes from one checkpoint to the next
+
+// Where row n starts in the synthetic file
+off_t checkRowPos(ssize_t n) {
+    return (off_t)(n / PAGER_CHECKPOINT) * CHECK_GAP +
+        n % PAGER_CHECKPOINT * CHECK_LINE;
+}
+
+// Write the rows from n's checkpoint up to n itself, each its own number
+int checkWriteRows(int fd, ssize_t n) {
+    char line[CHECK_LINE + 1];
+    ssize_t j;
+
+    for (j = n - n % PAGER_CHECKPOINT; j <= n; j++) {
+        snprintf(line, sizeof(line), "%019zd\n", j);
+        if (pwrite(fd, line, CHECK_LINE, checkRowPos(j)) != CHECK_LINE)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * kilo --selftest
+ * Page through a sparse file with more than 2^32 rows. Its checkpoint
+ * table is filled in arithmetically instead of by scanning, and only
+ * the rows looked at are written, the rest of the file is a hole.
+ * Each one must come back from pagerRow() and editorRowForOffset()
+ * as the row it says it is. Returns nonzero when any doesn't
+ */
+int editorSelfCheck() {
+    static const ssize_t probes[] = {
+        0, 1, 7,
+        ((ssize_t)1 << 31) - PAGER_CHECKPOINT,
+        ((ssize_t)1 << 31), ((ssize_t)1 << 31) + 1, ((ssize_t)1 << 31) + 9,
+        ((ssize_t)1 << 32), ((ssize_t)1 << 32) + 5,
+        CHECK_ROWS - 1
+    };
+    int nprobes = sizeof(probes) / sizeof(probes[0]), failed = 0, j;
+
+    char tmp[] = "/tmp/kilo-selftest-XXXXXX";
+    int fd = mkstemp(tmp);
+    if (fd == -1) die("mkstemp");
+    unlink(tmp);
+    off_t size = checkRowPos(CHECK_ROWS - 1) + CHECK_LINE;
+    if (ftruncate(fd, size) == -1) die("ftruncate");
+    for (j = 0; j < nprobes; j++)
+        if (checkWriteRows(fd, probes[j]) == -1) die("pwrite");
+
+    E.backend = BACKEND_PAGER;
+    E.pagerbudget = PAGER_BUDGET;
+    pagerOpen(fd, size);
+    struct pager* p = &E.pager;
+    size_t k, ncheck = (CHECK_ROWS - 1) / PAGER_CHECKPOINT + 1;
+    p->checkpoints = realloc(p->checkpoints, sizeof(off_t) * ncheck);
+    if (p->checkpoints == NULL) die("realloc");
+    for (k = 0; k < ncheck; k++) p->checkpoints[k] = (off_t)k * CHECK_GAP;
+    p->ncheckpoints = p->checkcap = ncheck;
+    p->scanned = size;
+    p->lines = CHECK_ROWS;
+    p->lastbyte = '\n';
+    E.numrows = CHECK_ROWS;
+    E.indexdone = 1;
+
+    printf("pager, %zd rows in %zu checkpoints:\n", (ssize_t)CHECK_ROWS, ncheck);
+    for (j = 0; j < nprobes; j++) {
+        ssize_t n = probes[j], at, col;
+        char want[CHECK_LINE + 1];
+        snprintf(want, sizeof(want), "%019zd", n);
+
+        erow* row = pagerRow(n);
+        int rowok = row->size == CHECK_LINE - 1 &&
+            memcmp(erowChars(row), want, CHECK_LINE - 1) == 0;
+        printf("  row %-11zd %-6s", n, rowok ? "ok" : "FAILED");
+        if (!rowok) printf(" (read \"%.*s\")", (int)row->size, erowChars(row));
+
+        // A few bytes into the row, to check the column as well
+        at = editorRowForOffset(checkRowPos(n) + 7, &col);
+        int offok = at == n && col == 7;
+        printf("  offset %s", offok ? "ok" : "FAILED");
+        if (!offok) printf(" (row %zd col %zd)", at, col);
+        printf("\n");
+        failed += !rowok + !offok;
+    }
+
+    pagerClose();
+    E.numrows = 0;
+    E.indexdone = 0;
+    printf("%s\n", failed ? "FAILED" : "ok");
+    return failed != 0;
 }
 
 /*** init ***/
@@ -528,18 +4877,117 @@ void initEditor() {
     E.rowoff = 0;
     E.coloff = 0;
     E.numrows = 0;
+    E.rowcap = 0;
     E.row = NULL;
+    E.rowarena.head = NULL;
+    E.filemap = NULL;
+    E.filemapsize = 0;
+    E.index.offs = NULL;
+    E.index.len = E.index.cap = 0;
+    E.indexed = 0;
+    E.indexdone = 0;
+    E.winstart = E.winlen = 0;
+
+    E.filename = NULL;
+    E.statusmsg[0] = '\0';
+    E.statusmsg_time = 0;
+    E.loader.running = 0;
 
     if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
+    E.screenrows -= 2; // Room for the status and message bars
+    E.screen.sync = getSyncOutput();
+}
+
+void usage() {
+    fprintf(stderr, "Usage: kilo [-B array|piece|rope|soa|lazy|pager] [-m margin] [-a]\n"
+                    "            [-M budget-mb] [-r] [-t threads] [-z] [-d] [file]\n"
+                    "       kilo --bench <file>\n"
+                    "       kilo --selftest\n");
+    exit(1);
 }
 
 int main(int argc, char* argv[]) {
+    // wcwidth() needs to know the text is UTF-8, as it is drawn
+    if (setlocale(LC_CTYPE, "") == NULL || MB_CUR_MAX == 1)
+        setlocale(LC_CTYPE, "C.UTF-8");
+    E.indexthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (E.indexthreads < 1) E.indexthreads = 1;
+    if (argc >= 3 && strcmp(argv[1], "--bench") == 0)
+        return editorBenchmark(argv[2]);
+    if (argc >= 2 && strcmp(argv[1], "--selftest") == 0)
+        return editorSelfCheck();
+
+    int backend = BACKEND_ARRAY;
+    int margin = LAZY_MARGIN;
+    int async = 0;
+    int chunkedread = 0;
+    int coldstore = 0;
+    int intern = 0;
+    size_t budget = PAGER_BUDGET;
+    int opt;
+    while ((opt = getopt(argc, argv, "B:m:aM:rt:zd")) != -1) {
+        switch (opt) {
+            case 'B':
+                if (strcmp(optarg, "array") == 0) backend = BACKEND_ARRAY;
+                else if (strcmp(optarg, "piece") == 0) backend = BACKEND_PIECE;
+                else if (strcmp(optarg, "rope") == 0) backend = BACKEND_ROPE;
+                else if (strcmp(optarg, "soa") == 0) backend = BACKEND_SOA;
+                else if (strcmp(optarg, "lazy") == 0) backend = BACKEND_LAZY;
+                else if (strcmp(optarg, "pager") == 0) backend = BACKEND_PAGER;
+                else usage();
+                break;
+            case 'm':
+                margin = atoi(optarg);
+                if (margin < 0) usage();
+                break;
+            case 'a':
+                // Only the lazy backend can show rows before the index is done
+                async = 1;
+                backend = BACKEND_LAZY;
+                break;
+            case 'M':
+                if (atoi(optarg) <= 0) usage();
+                budget = (size_t)atoi(optarg) * 1024 * 1024;
+                break;
+            case 'r':
+                chunkedread = 1;
+                break;
+            case 't':
+                if (atoi(optarg) <= 0) usage();
+                E.indexthreads = atoi(optarg);
+                break;
+            case 'z':
+                // Only the pager can read its pages out of the cold store
+                coldstore = 1;
+                backend = BACKEND_PAGER;
+                break;
+            case 'd':
+                // Rows sharing copies only makes sense with one erow per line
+                intern = 1;
+                backend = BACKEND_ARRAY;
+                break;
+            default:
+                usage();
+        }
+    }
+
     enableRawMode();
     initEditor();
-    if (argc >= 2) {
-        editorOpen(argv[1]);
+    E.backend = backend;
+    E.lazymargin = margin;
+    E.async = async;
+    E.chunkedread = chunkedread;
+    E.coldstore = coldstore;
+    E.intern = intern;
+    E.pagerbudget = budget;
+    if (optind < argc) {
+        editorOpen(argv[optind]);
     }
 
+    // Unless opening the file had something to say
+    if (E.statusmsg[0] == '\0')
+        editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-G = go to line | Ctrl-Q = quit");
+
     while(1) {
         editorRefreshScreen();
         editorProcessKeyPress();